@@ -0,0 +1,101 @@
+/*!
+  Benchmark of the storage types of the recursive DoG sharpening.
+
+  Runs fsiv_image_sharpening() with filter 3 (DoG using recursive Gaussians)
+  for each storage type of the intermediate images, reporting the time and
+  the max abs error against FSIV_STORE_F32, for gray, color and luma only
+  images. It exits with a failure code when the error goes over the bound
+  stated in common_code.hpp.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <exception>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#include "common_code.hpp"
+
+const cv::String keys =
+    "{help h usage ? |      | print this message.}"
+    "{s size         |512   | Image size (size x size). Default 512.}"
+    "{r1             |5     | r1 for DoG filter. Default 5.}"
+    "{r2             |15    | r2 for DoG filter. (0<r1<r2) Default 15.}"
+    ;
+
+// Max error of the 16 bit storage against FSIV_STORE_F32 (see common_code.hpp).
+const double STORE_MAX_ERROR_8U = 1.0;
+
+int
+main (int argc, char* const* argv)
+{
+    int retCode=EXIT_SUCCESS;
+
+    try {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark the storage types of the recursive DoG sharpening.");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        const int size = parser.get<int>("s");
+        const int r1 = parser.get<int>("r1");
+        const int r2 = parser.get<int>("r2");
+        if (!parser.check() || size<1 || r1<=0 || r2<=r1)
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+
+        cv::Mat in(size, size, CV_8UC3);
+        cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+
+        const char* storage_names[] = {"f32", "f16", "s16"};
+        const char* image_names[] = {"gray", "color", "luma"};
+        std::cout << std::setw(8) << "image"
+                  << std::setw(10) << "storage"
+                  << std::setw(14) << "time (ms)"
+                  << std::setw(14) << "max error" << std::endl;
+        for (int image = 0; image < 3; ++image)
+        {
+            cv::Mat img = in;
+            if (image == 0)
+                cv::extractChannel(in, img, 0);
+            const bool only_luma = (image == 2);
+            for (const bool circular : {false, true})
+            {
+                const cv::Mat ref = fsiv_image_sharpening(img, 3, only_luma, r1, r2,
+                                                          circular, FSIV_STORE_F32);
+                for (int storage = FSIV_STORE_F32; storage <= FSIV_STORE_S16; ++storage)
+                {
+                    const int64 t0 = cv::getTickCount();
+                    const cv::Mat out = fsiv_image_sharpening(img, 3, only_luma, r1, r2,
+                                                              circular, storage);
+                    const double t = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+                    const double error = cv::norm(ref, out, cv::NORM_INF);
+
+                    std::cout << std::setw(8) << image_names[image]
+                              << std::setw(10) << storage_names[storage]
+                              << std::setw(14) << std::fixed << std::setprecision(2) << t
+                              << std::setw(14) << std::setprecision(0) << error;
+                    if (circular)
+                        std::cout << "  (circular)";
+                    if (error > STORE_MAX_ERROR_8U)
+                    {
+                        std::cout << "  FAIL";
+                        retCode = EXIT_FAILURE;
+                    }
+                    std::cout << std::endl;
+                }
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Capturada excepcion: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
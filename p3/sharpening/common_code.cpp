@@ -1,28 +1,707 @@
 #include <iostream>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
 #include "common_code.hpp"
 #include <opencv2/imgproc.hpp>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
+namespace {
+
+// Working buffers of the recursive filters are sized to fit in L2.
+const size_t BLOCK_BYTES = 256*1024;
+
+// Young - van Vliet coefficients {B, b1/b0, b2/b0, b3/b0}.
+void
+yvv_coefficients(double sigma, float c[4])
+{
+    const double q = (sigma >= 2.5) ? 0.98711*sigma - 0.96330
+                                    : 3.97156 - 4.14554*std::sqrt(1.0 - 0.26891*sigma);
+    const double q2 = q*q;
+    const double q3 = q2*q;
+    const double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+    const double b1 = (2.44413*q + 2.85619*q2 + 1.26661*q3)/b0;
+    const double b2 = -(1.4281*q2 + 1.26661*q3)/b0;
+    const double b3 = 0.422205*q3/b0;
+    c[0] = 1.0 - (b1 + b2 + b3);
+    c[1] = b1;
+    c[2] = b2;
+    c[3] = b3;
+}
+
+// Forward and backward recursion over 'lanes' signals of length n stored
+// interleaved (sample i of lane l is at buf[(i+3)*lanes+l]). The three
+// samples before and after the signal must be zero. The inner loops run
+// across lanes so they are vectorized.
+void
+yvv_filter_lanes(float* buf, int n, int lanes, const float c[4])
+{
+    for (int i = 3; i < n+3; ++i)
+    {
+        float* x = buf + i*lanes;
+        const float* x1 = x - lanes;
+        const float* x2 = x1 - lanes;
+        const float* x3 = x2 - lanes;
+        for (int l = 0; l < lanes; ++l)
+            x[l] = c[0]*x[l] + c[1]*x1[l] + c[2]*x2[l] + c[3]*x3[l];
+    }
+    for (int i = n+2; i >= 3; --i)
+    {
+        float* x = buf + i*lanes;
+        const float* x1 = x + lanes;
+        const float* x2 = x1 + lanes;
+        const float* x3 = x2 + lanes;
+        for (int l = 0; l < lanes; ++l)
+            x[l] = c[0]*x[l] + c[1]*x1[l] + c[2]*x2[l] + c[3]*x3[l];
+    }
+}
+
+// Source index of each sample of a line of length n extended pad samples
+// per side. -1 means a zero sample.
+std::vector<int>
+border_table(int n, int pad, bool circular)
+{
+    std::vector<int> idx(n + 2*pad);
+    for (int i = 0; i < n + 2*pad; ++i)
+    {
+        int j = i - pad;
+        if (circular)
+            j = ((j % n) + n) % n;
+        else if (j < 0 || j >= n)
+            j = -1;
+        idx[i] = j;
+    }
+    return idx;
+}
+
+// Sharpening with the 3x3 laplacians in fixed point. The taps are 5/-1 (LAP_4)
+// and 9/-1 (LAP_8) so the results fit in 16 bits and the output is exactly
+// the saturated float result.
+inline uchar
+lap_pixel(bool lap8, int c, int n, int s, int w, int e,
+          int nw, int ne, int sw, int se)
+{
+    const int v = lap8 ? 9*c - (n + s + w + e + nw + ne + sw + se)
+                       : 5*c - (n + s + w + e);
+    return cv::saturate_cast<uchar>(v);
+}
+
+// Bytes [x0, x1) of a row. The horizontal neighbours are cn bytes away so
+// it must be cn<=x0 and x1<=width-cn.
+template<bool LAP8>
+void
+lap_row_8u(const uchar* u, const uchar* m, const uchar* d, uchar* dst,
+           int x0, int x1, int cn)
+{
+    int x = x0;
+#if defined(__AVX2__)
+    // 32 pixels per iteration, two halves of 16 x int16.
+    const __m256i zero = _mm256_setzero_si256();
+    for (; x + 32 <= x1; x += 32)
+    {
+#define LOAD(p) _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))
+        const __m256i c = LOAD(m + x);
+        __m256i nb[8];
+        nb[0] = LOAD(u + x); nb[1] = LOAD(d + x);
+        nb[2] = LOAD(m + x - cn); nb[3] = LOAD(m + x + cn);
+        if (LAP8)
+        {
+            nb[4] = LOAD(u + x - cn); nb[5] = LOAD(u + x + cn);
+            nb[6] = LOAD(d + x - cn); nb[7] = LOAD(d + x + cn);
+        }
+#undef LOAD
+        __m256i res[2];
+        for (int h = 0; h < 2; ++h)
+        {
+            const __m256i c16 = h ? _mm256_unpackhi_epi8(c, zero)
+                                  : _mm256_unpacklo_epi8(c, zero);
+            __m256i v = _mm256_add_epi16(_mm256_slli_epi16(c16, LAP8 ? 3 : 2), c16);
+            for (int k = 0; k < (LAP8 ? 8 : 4); ++k)
+                v = _mm256_sub_epi16(v, h ? _mm256_unpackhi_epi8(nb[k], zero)
+                                          : _mm256_unpacklo_epi8(nb[k], zero));
+            res[h] = v;
+        }
+        // unpack/pack work within 128 bit lanes, so the order is kept.
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x),
+                            _mm256_packus_epi16(res[0], res[1]));
+    }
+#elif defined(__SSE2__)
+    // 16 pixels per iteration, two halves of 8 x int16.
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= x1; x += 16)
+    {
+#define LOAD(p) _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))
+        const __m128i c = LOAD(m + x);
+        __m128i nb[8];
+        nb[0] = LOAD(u + x); nb[1] = LOAD(d + x);
+        nb[2] = LOAD(m + x - cn); nb[3] = LOAD(m + x + cn);
+        if (LAP8)
+        {
+            nb[4] = LOAD(u + x - cn); nb[5] = LOAD(u + x + cn);
+            nb[6] = LOAD(d + x - cn); nb[7] = LOAD(d + x + cn);
+        }
+#undef LOAD
+        __m128i res[2];
+        for (int h = 0; h < 2; ++h)
+        {
+            const __m128i c16 = h ? _mm_unpackhi_epi8(c, zero)
+                                  : _mm_unpacklo_epi8(c, zero);
+            __m128i v = _mm_add_epi16(_mm_slli_epi16(c16, LAP8 ? 3 : 2), c16);
+            for (int k = 0; k < (LAP8 ? 8 : 4); ++k)
+                v = _mm_sub_epi16(v, h ? _mm_unpackhi_epi8(nb[k], zero)
+                                       : _mm_unpacklo_epi8(nb[k], zero));
+            res[h] = v;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+                         _mm_packus_epi16(res[0], res[1]));
+    }
+#endif
+    for (; x < x1; ++x)
+        dst[x] = lap_pixel(LAP8, m[x], u[x], d[x], m[x-cn], m[x+cn],
+                           u[x-cn], u[x+cn], d[x-cn], d[x+cn]);
+}
+
+// Sharpen an 8 bit image (any number of interleaved channels) with LAP_4 or
+// LAP_8. The border is one pixel of zeros or a circular extension, but it is
+// not copied: the rows above/below are chosen by index and the first/last
+// pixel of each row are done apart.
 cv::Mat
-fsiv_create_gaussian_filter(const int r)
+lap_sharpening_8u(const cv::Mat& in, bool lap8, bool circular)
 {
-    CV_Assert(r>0);
-    cv::Mat ret_v;
+    CV_Assert(in.depth()==CV_8U);
+    const int cn = in.channels();
+    const int width = in.cols*cn;
+    cv::Mat out(in.size(), in.type());
+    const std::vector<uchar> zeros(width, 0);
 
-    //TODO: Remenber 6*sigma is approx 99,73% of the distribution.
+    for (int y = 0; y < in.rows; ++y)
+    {
+        const uchar* m = in.ptr<uchar>(y);
+        const uchar* u = (y > 0) ? in.ptr<uchar>(y-1)
+                       : (circular ? in.ptr<uchar>(in.rows-1) : zeros.data());
+        const uchar* d = (y < in.rows-1) ? in.ptr<uchar>(y+1)
+                       : (circular ? in.ptr<uchar>(0) : zeros.data());
+        uchar* dst = out.ptr<uchar>(y);
 
+        if (width > 2*cn)
+        {
+            if (lap8)
+                lap_row_8u<true>(u, m, d, dst, cn, width-cn, cn);
+            else
+                lap_row_8u<false>(u, m, d, dst, cn, width-cn, cn);
+        }
+
+        // First and last pixels.
+        for (int x = 0; x < width; ++x)
+        {
+            if (x == cn && width-cn > cn)
+                x = width-cn;
+            int l = x - cn;
+            int r = x + cn;
+            if (l < 0)
+                l = circular ? l + width : -1;
+            if (r >= width)
+                r = circular ? r - width : -1;
+#define AT(p, i) ((i) < 0 ? 0 : (p)[i])
+            dst[x] = lap_pixel(lap8, m[x], u[x], d[x], AT(m, l), AT(m, r),
+                               AT(u, l), AT(u, r), AT(d, l), AT(d, r));
+#undef AT
+        }
+    }
+    return out;
+}
 
+cv::Mat
+make_gaussian_kernel(int r)
+{
     float sigma = ((float)(2*r+1))/6.0;
-    ret_v = cv::Mat::zeros(2*r+1, 2*r+1, CV_32F);
+    cv::Mat k = cv::Mat::zeros(2*r+1, 2*r+1, CV_32F);
 
     for (int i = r; i >= -r; --i){
         for(int j = -r; j <= r; ++j){
             float dividendo = - (std::pow(i, 2) + std::pow(j, 2));
             float divisor = 2 * std::pow(sigma, 2);
-            ret_v.at<float>(i+r, j+r) = std::exp(dividendo/divisor);
+            k.at<float>(i+r, j+r) = std::exp(dividendo/divisor);
+        }
+    }
+
+    cv::normalize(k, k, 1.0, 0.0, cv::NORM_L1);
+    return k;
+}
+
+// The sharpening filter is impulse - DoG, with DoG = G[r2]-G[r1].
+cv::Mat
+make_sharpening_kernel(int filter_type, int r1, int r2)
+{
+    cv::Mat filter;
+    if (filter_type == 0){
+        float data_impulso[9] = { 0, 0, 0, 0, 1, 0, 0, 0, 0 };
+        cv::Mat impulso = cv::Mat(3, 3, CV_32FC1, data_impulso);
+        float data_lap_4[9] = { 0, 1, 0, 1, -4, 1, 0, 1, 0 };
+        cv::Mat lap_4 = cv::Mat(3, 3, CV_32FC1, data_lap_4);
+
+        filter = impulso - lap_4;
+
+    } else if (filter_type == 1) {
+        float data_impulso[9] = { 0, 0, 0, 0, 1, 0, 0, 0, 0 };
+        cv::Mat impulso = cv::Mat(3, 3, CV_32FC1, data_impulso);
+        float data_lap_8[9] = { 1, 1, 1, 1, -8, 1, 1, 1, 1 };
+        cv::Mat lap_8 = cv::Mat(3, 3, CV_32FC1, data_lap_8);
+
+        filter = impulso - lap_8;
+
+    } else if (filter_type == 2){
+        cv::Mat G_r1 = fsiv_get_kernel(FSIV_GAUSSIAN_KERNEL, r1)->kernel;
+        cv::Mat G_r2 = fsiv_get_kernel(FSIV_GAUSSIAN_KERNEL, r2)->kernel;
+        G_r1 = fsiv_extend_image(G_r1, G_r2.size());
+
+        cv::Mat impulso = cv::Mat::zeros(G_r1.size(), CV_32FC1);
+        impulso.at<float>(r2, r2) = 1;
+
+        cv::Mat dog = G_r2 - G_r1;
+        filter = impulso - dog;
+    }
+    return filter;
+}
+
+// Storage of the intermediate images. The arithmetic is always in float.
+template<class S>
+struct Storage
+{
+    static float load(S v) { return v; }
+    static S save(float v) { return v; }
+};
+
+template<>
+struct Storage<cv::float16_t>
+{
+    static float load(cv::float16_t v) { return static_cast<float>(v); }
+    static cv::float16_t save(float v) { return cv::float16_t(v); }
+};
+
+// 16 bit fixed point with FIXED_BITS fractional bits, for 8 bit images.
+const int FIXED_BITS = 7;
+
+template<>
+struct Storage<short>
+{
+    static float load(short v) { return v*(1.0f/(1 << FIXED_BITS)); }
+    static short save(float v) { return cv::saturate_cast<short>(v*(1 << FIXED_BITS)); }
+};
+
+// Recursive Gaussian blur of in (samples of type T) into dst, that has
+// in.rows rows of in.cols*in.channels() samples of type S. The intermediate
+// image is also stored as S.
+template<class T, class S>
+void
+recursive_blur(const cv::Mat& in, int r, bool circular, S* dst)
+{
+    float c[4];
+    yvv_coefficients((2*r+1)/6.0, c);
+    const int cn = in.channels();
+    const int pad = 2*r + 4;
+    const int width = in.cols*cn;
+    std::vector<S> tmp(in.rows*width);
+
+    // Horizontal pass: a block of rows is transposed so each row is a lane.
+    {
+        const std::vector<int> idx = border_table(in.cols, pad, circular);
+        const int len = static_cast<int>(idx.size());
+        const int block = std::max<int>(1, BLOCK_BYTES/((len+6)*cn*sizeof(float)));
+        std::vector<float> buf;
+        for (int y0 = 0; y0 < in.rows; y0 += block)
+        {
+            const int rows = std::min(block, in.rows - y0);
+            const int lanes = rows*cn;
+            buf.assign((len+6)*lanes, 0.0f);
+            for (int b = 0; b < rows; ++b)
+            {
+                const T* src = in.ptr<T>(y0+b);
+                for (int i = 0; i < len; ++i)
+                    if (idx[i] >= 0)
+                        for (int k = 0; k < cn; ++k)
+                            buf[(i+3)*lanes + b*cn + k] = src[idx[i]*cn + k];
+            }
+            yvv_filter_lanes(buf.data(), len, lanes, c);
+            for (int b = 0; b < rows; ++b)
+            {
+                S* row = &tmp[(y0+b)*width];
+                for (int x = 0; x < in.cols; ++x)
+                    for (int k = 0; k < cn; ++k)
+                        row[x*cn + k] = Storage<S>::save(buf[(x+pad+3)*lanes + b*cn + k]);
+            }
+        }
+    }
+
+    // Vertical pass: a strip of columns is processed at once, one lane per
+    // column, so the recursion is vectorized across the strip.
+    {
+        const std::vector<int> idx = border_table(in.rows, pad, circular);
+        const int len = static_cast<int>(idx.size());
+        const int strip = std::max<int>(8, (BLOCK_BYTES/((len+6)*sizeof(float))) & ~7);
+        std::vector<float> buf;
+        for (int x0 = 0; x0 < width; x0 += strip)
+        {
+            const int lanes = std::min(strip, width - x0);
+            buf.assign((len+6)*lanes, 0.0f);
+            for (int i = 0; i < len; ++i)
+                if (idx[i] >= 0)
+                {
+                    const S* row = &tmp[idx[i]*width + x0];
+                    for (int l = 0; l < lanes; ++l)
+                        buf[(i+3)*lanes + l] = Storage<S>::load(row[l]);
+                }
+            yvv_filter_lanes(buf.data(), len, lanes, c);
+            for (int y = 0; y < in.rows; ++y)
+            {
+                S* row = dst + y*width + x0;
+                for (int l = 0; l < lanes; ++l)
+                    row[l] = Storage<S>::save(buf[(y+pad+3)*lanes + l]);
+            }
+        }
+    }
+}
+
+// DoG sharpening with recursive Gaussians of an 8 bit image. As
+// -DoG = G[r1]-G[r2], out = in + G[r1]*in - G[r2]*in. The blurs are
+// stored as S.
+template<class S>
+cv::Mat
+recursive_dog_sharpening(const cv::Mat& src, int r1, int r2, bool circular)
+{
+    const int width = src.cols*src.channels();
+    std::vector<S> b1(src.rows*width);
+    std::vector<S> b2(src.rows*width);
+    recursive_blur<uchar, S>(src, r1, circular, b1.data());
+    recursive_blur<uchar, S>(src, r2, circular, b2.data());
+    cv::Mat out(src.size(), src.type());
+    for (int y = 0; y < src.rows; ++y)
+    {
+        const uchar* in = src.ptr<uchar>(y);
+        const S* g1 = &b1[y*width];
+        const S* g2 = &b2[y*width];
+        uchar* dst = out.ptr<uchar>(y);
+        for (int x = 0; x < width; ++x)
+            dst[x] = cv::saturate_cast<uchar>(static_cast<float>(in[x])
+                                              + Storage<S>::load(g1[x])
+                                              - Storage<S>::load(g2[x]));
+    }
+    return out;
+}
+
+// Outputs of a convolution tile, accumulated in registers along the whole
+// kernel.
+const int CONV_TILE = 64;
+
+// Correlate the K x K kernel taps with the K rows into the width elements
+// of dst. K is known at compile time, so the loops over the taps are fully
+// unrolled by the compiler. The channels are interleaved, so the taps are
+// cn elements apart.
+template<int K>
+void
+conv_row_fixed_8u(const uchar* const* rows, const float* taps, int cn, int width,
+                  uchar* dst)
+{
+    float acc[CONV_TILE];
+    for (int x0 = 0; x0 < width; x0 += CONV_TILE)
+    {
+        const int n = std::min(CONV_TILE, width - x0);
+        std::fill(acc, acc + n, 0.0f);
+        for (int i = 0; i < K; ++i)
+        {
+            const uchar* row = rows[i] + x0;
+            for (int j = 0; j < K; ++j)
+            {
+                const float t = taps[i*K + j];
+                const uchar* x = row + j*cn;
+                for (int o = 0; o < n; ++o)
+                    acc[o] += t*x[o];
+            }
         }
+        for (int o = 0; o < n; ++o)
+            dst[x0 + o] = cv::saturate_cast<uchar>(acc[o]);
     }
+}
+
+// Valid correlation of the 8 bit image in with the K x K kernel k into out
+// (out.size() <= in.size() - K + 1). The taps are copied to the stack.
+template<int K>
+void
+conv_fixed_8u(const cv::Mat& in, const cv::Mat& k, cv::Mat& out)
+{
+    CV_Assert(k.rows==K && k.cols==K && k.isContinuous());
+    const int cn = in.channels();
+    float taps[K*K];
+    std::copy(k.ptr<float>(), k.ptr<float>() + K*K, taps);
+    const uchar* rows[K];
+    for (int y = 0; y < out.rows; ++y)
+    {
+        for (int i = 0; i < K; ++i)
+            rows[i] = in.ptr<uchar>(y+i);
+        conv_row_fixed_8u<K>(rows, taps, cn, out.cols*cn, out.ptr<uchar>(y));
+    }
+}
 
-    cv::normalize(ret_v, ret_v, 1.0, 0.0, cv::NORM_L1);
+// DoG sharpening (filter_type 2) of an 8 bit image. The kernels of radius
+// 1 to 7 (the usual ones) use a convolution specialized for their size,
+// the others cv::filter2D.
+cv::Mat
+dog_sharpening_8u(const cv::Mat& src, const cv::Mat& filter, bool circular)
+{
+    cv::Size new_size = cv::Size(src.cols + filter.cols, src.rows + filter.rows);
+    cv::Mat ext = fsiv_extend_image(src, new_size, circular);
+    cv::Mat out(src.size(), src.type());
+    switch (filter.rows)
+    {
+    case 3: conv_fixed_8u<3>(ext, filter, out); return out;
+    case 5: conv_fixed_8u<5>(ext, filter, out); return out;
+    case 7: conv_fixed_8u<7>(ext, filter, out); return out;
+    case 9: conv_fixed_8u<9>(ext, filter, out); return out;
+    case 11: conv_fixed_8u<11>(ext, filter, out); return out;
+    case 13: conv_fixed_8u<13>(ext, filter, out); return out;
+    case 15: conv_fixed_8u<15>(ext, filter, out); return out;
+    default: break;
+    }
+    cv::filter2D(ext, ext, -1, filter);
+    return ext(cv::Rect(filter.cols/2, filter.rows/2, src.cols, src.rows)).clone();
+}
+
+// Luma (V = max(B,G,R)) of row y of a BGR image, extended r samples on
+// both sides, into v.
+void
+luma_row(const cv::Mat& in, int y, int r, bool circular, uchar* v)
+{
+    const uchar* src = in.ptr<uchar>(y);
+    for (int x = -r; x < in.cols + r; ++x)
+    {
+        int sx = x;
+        if (sx < 0 || sx >= in.cols)
+        {
+            if (!circular)
+            {
+                v[x+r] = 0;
+                continue;
+            }
+            sx = ((sx % in.cols) + in.cols) % in.cols;
+        }
+        const uchar* p = src + 3*sx;
+        v[x+r] = std::max(p[0], std::max(p[1], p[2]));
+    }
+}
+
+// Correlate the K x K kernel k with the K rows (extended K/2 samples on
+// both sides) into the cols samples of dst.
+void
+filter_row_8u(const uchar* const* rows, const float* k, int K, int cols,
+              uchar* dst)
+{
+    float acc[CONV_TILE];
+    for (int x0 = 0; x0 < cols; x0 += CONV_TILE)
+    {
+        const int n = std::min(CONV_TILE, cols - x0);
+        std::fill(acc, acc + n, 0.0f);
+        for (int i = 0; i < K; ++i)
+            for (int j = 0; j < K; ++j)
+            {
+                const float t = k[i*K + j];
+                const uchar* x = rows[i] + x0 + j;
+                for (int o = 0; o < n; ++o)
+                    acc[o] += t*x[o];
+            }
+        for (int o = 0; o < n; ++o)
+            dst[x0 + o] = cv::saturate_cast<uchar>(acc[o]);
+    }
+}
+
+// Scale the BGR pixels of row y of in by V'/V into out, so their luma
+// becomes V' (the HSV hue and saturation are kept). A black pixel has no
+// hue, so it becomes the gray V'.
+void
+rescale_row(const cv::Mat& in, const uchar* v, const uchar* v_new, int y,
+            cv::Mat& out)
+{
+    const uchar* src = in.ptr<uchar>(y);
+    uchar* dst = out.ptr<uchar>(y);
+    for (int x = 0; x < in.cols; ++x)
+    {
+        if (v[x] == 0)
+        {
+            dst[3*x] = dst[3*x+1] = dst[3*x+2] = v_new[x];
+            continue;
+        }
+        const float s = static_cast<float>(v_new[x])/v[x];
+        for (int c = 0; c < 3; ++c)
+            dst[3*x+c] = cv::saturate_cast<uchar>(s*src[3*x+c]);
+    }
+}
+
+// Stream the luma of a BGR image through a ring buffer of 2r+1 rows: each
+// output row is filtered by filter_row(rows, v_new), from the 2r+1 rows of
+// luma extended r samples on both sides, and the pixels are rescaled while
+// they are in cache.
+template<class RowFilter>
+cv::Mat
+luma_stream_8u(const cv::Mat& in, int r, bool circular, RowFilter filter_row)
+{
+    cv::Mat out(in.size(), in.type());
+    const int K = 2*r + 1;
+    const int width = in.cols + 2*r;
+
+    // Slot (y mod K) of the ring holds the extended luma of row y-r.
+    std::vector<uchar> ring(K*width);
+    std::vector<const uchar*> rows(K);
+    std::vector<uchar> v_new(in.cols);
+    const auto fill = [&](int y)
+    {
+        uchar* v = &ring[(y % K)*width];
+        const int sy = y - r;
+        if (sy >= 0 && sy < in.rows)
+            luma_row(in, sy, r, circular, v);
+        else if (circular)
+            luma_row(in, ((sy % in.rows) + in.rows) % in.rows, r, circular, v);
+        else
+            std::fill(v, v + width, 0);
+    };
+    for (int y = 0; y < K-1; ++y)
+        fill(y);
+    for (int y = 0; y < in.rows; ++y)
+    {
+        fill(y + K-1);
+        for (int i = 0; i < K; ++i)
+            rows[i] = &ring[((y+i) % K)*width];
+        filter_row(rows.data(), v_new.data());
+        rescale_row(in, rows[r] + r, v_new.data(), y, out);
+    }
+    return out;
+}
+
+// Luma sharpening with the K x K kernel k, K known at compile time.
+template<int K>
+cv::Mat
+luma_conv_fixed_8u(const cv::Mat& in, const cv::Mat& k, bool circular)
+{
+    CV_Assert(k.rows==K && k.cols==K && k.isContinuous());
+    float taps[K*K];
+    std::copy(k.ptr<float>(), k.ptr<float>() + K*K, taps);
+    const int cols = in.cols;
+    return luma_stream_8u(in, K/2, circular,
+                          [&](const uchar* const* rows, uchar* dst)
+                          { conv_row_fixed_8u<K>(rows, taps, 1, cols, dst); });
+}
+
+// Sharpening of the luma of a BGR image without HSV conversion, in one
+// streaming pass (see luma_stream_8u()). LAP_4 and LAP_8 are done in fixed
+// point and the DoG kernels of radius 1 to 7 with a convolution specialized
+// for their size, as for the gray images. The recursive DoG (filter_type 3)
+// needs the whole luma plane, so it is done in three passes (luma, filter,
+// rescale).
+cv::Mat
+luma_sharpening_8u(const cv::Mat& in, int filter_type, int r1, int r2,
+                   bool circular, int storage)
+{
+    if (filter_type == 3)
+    {
+        cv::Mat out(in.size(), in.type());
+        cv::Mat v(in.size(), CV_8UC1);
+        for (int y = 0; y < in.rows; ++y)
+            luma_row(in, y, 0, circular, v.ptr<uchar>(y));
+        cv::Mat v_new;
+        if (storage == FSIV_STORE_F16)
+            v_new = recursive_dog_sharpening<cv::float16_t>(v, r1, r2, circular);
+        else if (storage == FSIV_STORE_S16)
+            v_new = recursive_dog_sharpening<short>(v, r1, r2, circular);
+        else
+            v_new = recursive_dog_sharpening<float>(v, r1, r2, circular);
+        for (int y = 0; y < in.rows; ++y)
+            rescale_row(in, v.ptr<uchar>(y), v_new.ptr<uchar>(y), y, out);
+        return out;
+    }
+
+    // The rows are extended one sample on both sides, as lap_row_8u() needs.
+    const int cols = in.cols;
+    if (filter_type == 0)
+        return luma_stream_8u(in, 1, circular,
+                              [&](const uchar* const* rows, uchar* dst)
+                              { lap_row_8u<false>(rows[0]+1, rows[1]+1, rows[2]+1,
+                                                  dst, 0, cols, 1); });
+    if (filter_type == 1)
+        return luma_stream_8u(in, 1, circular,
+                              [&](const uchar* const* rows, uchar* dst)
+                              { lap_row_8u<true>(rows[0]+1, rows[1]+1, rows[2]+1,
+                                                 dst, 0, cols, 1); });
+
+    const cv::Mat k = fsiv_get_kernel(FSIV_DOG_KERNEL, r1, r2)->kernel;
+    CV_Assert(k.isContinuous());
+    switch (k.rows)
+    {
+    case 3: return luma_conv_fixed_8u<3>(in, k, circular);
+    case 5: return luma_conv_fixed_8u<5>(in, k, circular);
+    case 7: return luma_conv_fixed_8u<7>(in, k, circular);
+    case 9: return luma_conv_fixed_8u<9>(in, k, circular);
+    case 11: return luma_conv_fixed_8u<11>(in, k, circular);
+    case 13: return luma_conv_fixed_8u<13>(in, k, circular);
+    case 15: return luma_conv_fixed_8u<15>(in, k, circular);
+    default: break;
+    }
+    const int K = k.rows;
+    return luma_stream_8u(in, K/2, circular,
+                          [&](const uchar* const* rows, uchar* dst)
+                          { filter_row_8u(rows, k.ptr<float>(), K, cols, dst); });
+}
+
+} // namespace
+
+std::shared_ptr<const FilterKernel>
+fsiv_get_kernel(int type, int r1, int r2)
+{
+    CV_Assert(FSIV_GAUSSIAN_KERNEL<=type && type<=FSIV_DOG_KERNEL);
+    CV_Assert(type!=FSIV_GAUSSIAN_KERNEL || r1>0);
+    CV_Assert(type!=FSIV_DOG_KERNEL || (0<r1 && r1<r2));
+    typedef std::tuple<int, int, int> Key;
+    static std::mutex mutex;
+    static std::map<Key, std::shared_ptr<const FilterKernel>> cache;
+    // The laplacians do not depend on the radii.
+    if (type == FSIV_LAP4_KERNEL || type == FSIV_LAP8_KERNEL)
+        r1 = r2 = 0;
+    else if (type == FSIV_GAUSSIAN_KERNEL)
+        r2 = 0;
+    const Key key(type, r1, r2);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+    }
+
+    // Build it without holding the lock (the DoG asks for its Gaussians).
+    // If another thread wins the race its kernel is kept, so every caller
+    // sees the same one.
+    std::shared_ptr<FilterKernel> k = std::make_shared<FilterKernel>();
+    if (type == FSIV_GAUSSIAN_KERNEL)
+        k->kernel = make_gaussian_kernel(r1);
+    else
+        k->kernel = make_sharpening_kernel(type - FSIV_LAP4_KERNEL, r1, r2);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache.insert(std::make_pair(key, k)).first->second;
+}
+
+cv::Mat
+fsiv_create_gaussian_filter(const int r)
+{
+    CV_Assert(r>0);
+    cv::Mat ret_v;
+
+    //TODO: Remenber 6*sigma is approx 99,73% of the distribution.
+
+    ret_v = fsiv_get_kernel(FSIV_GAUSSIAN_KERNEL, r)->kernel.clone();
 
     //
     CV_Assert(ret_v.type()==CV_32FC1);
@@ -31,6 +710,21 @@ fsiv_create_gaussian_filter(const int r)
     return ret_v;
 }
 
+cv::Mat
+fsiv_recursive_gaussian_blur(cv::Mat const& in, const int r, bool circular)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.depth()==CV_32F);
+    CV_Assert(r>0);
+    cv::Mat ret_v(in.size(), in.type());
+
+    recursive_blur<float, float>(in, r, circular, ret_v.ptr<float>());
+
+    CV_Assert(ret_v.type()==in.type());
+    CV_Assert(ret_v.size()==in.size());
+    return ret_v;
+}
+
 cv::Mat
 fsiv_extend_image(const cv::Mat& img, const cv::Size& new_size, int ext_type)
 {
@@ -72,33 +766,7 @@ fsiv_create_sharpening_filter(const int filter_type, int r1, int r2)
     //Remenber DoG = G[r2]-G[r1].
     //Hint: use fsiv_extend_image() to extent G[r1].
 
-    if (filter_type == 0){
-        float data_impulso[9] = { 0, 0, 0, 0, 1, 0, 0, 0, 0 };
-        cv::Mat impulso = cv::Mat(3, 3, CV_32FC1, data_impulso);
-        float data_lap_4[9] = { 0, 1, 0, 1, -4, 1, 0, 1, 0 };
-        cv::Mat lap_4 = cv::Mat(3, 3, CV_32FC1, data_lap_4);
-
-        filter = impulso - lap_4;
-
-    } else if (filter_type == 1) {
-        float data_impulso[9] = { 0, 0, 0, 0, 1, 0, 0, 0, 0 };
-        cv::Mat impulso = cv::Mat(3, 3, CV_32FC1, data_impulso);
-        float data_lap_8[9] = { 1, 1, 1, 1, -8, 1, 1, 1, 1 };
-        cv::Mat lap_8 = cv::Mat(3, 3, CV_32FC1, data_lap_8);
-
-        filter = impulso - lap_8;
-
-    } else if (filter_type == 2){
-        cv::Mat G_r1 = fsiv_create_gaussian_filter(r1);
-        cv::Mat G_r2 = fsiv_create_gaussian_filter(r2);
-        G_r1 = fsiv_extend_image(G_r1, G_r2.size());
-
-        cv::Mat impulso = cv::Mat::zeros(G_r1.size(), CV_32FC1);
-        impulso.at<float>(r2, r2) = 1;
-
-        cv::Mat dog = G_r2 - G_r1;
-        filter = impulso - dog;
-    }
+    filter = fsiv_get_kernel(FSIV_LAP4_KERNEL + filter_type, r1, r2)->kernel.clone();
 
     //
     CV_Assert(filter.type()==CV_32FC1);
@@ -112,36 +780,34 @@ fsiv_create_sharpening_filter(const int filter_type, int r1, int r2)
 
 cv::Mat
 fsiv_image_sharpening(const cv::Mat& in, int filter_type, bool only_luma,
-                      int r1, int r2, bool circular)
+                      int r1, int r2, bool circular, int storage)
 {
     CV_Assert(in.depth()==CV_8U);
+    CV_Assert(FSIV_STORE_F32<=storage && storage<=FSIV_STORE_S16);
     CV_Assert(0<r1 && r1<r2);
-    CV_Assert(0<=filter_type && filter_type<=2);
+    CV_Assert(0<=filter_type && filter_type<=3);
     cv::Mat out;
     //TODO
     //Hint: use cv::filter2D.
     //Remenber: if circular, first the input image must be circular extended,
     //  and then clip the result.
 
-    cv::Mat filter = fsiv_create_sharpening_filter(filter_type, r1, r2);
-    cv::Size new_size = cv::Size(in.cols + filter.cols, in.rows + filter.rows);
-    cv::Mat aux;
-
-    if (only_luma){
-        std::vector<cv::Mat> channels;
-        cv::cvtColor(in, aux, cv::COLOR_BGR2HSV);
-        cv::split(aux, channels);
-        channels[2] = fsiv_extend_image(channels[2], new_size, circular);
-        cv::filter2D(channels[2], channels[2], -1, filter);
-        channels[2] = channels[2](cv::Rect(filter.cols/2, 
-            filter.rows/2, in.cols, in.rows)).clone();
-        cv::merge(channels, out);
-        cv::cvtColor(out, out, cv::COLOR_HSV2BGR);
-
+    // The luma is V = max(B,G,R), as in HSV, but no colour conversion is
+    // done: the sharpened V'/V rescales the BGR pixels.
+    if (only_luma && in.channels() == 3){
+        out = luma_sharpening_8u(in, filter_type, r1, r2, circular, storage);
+    } else if (filter_type == 3){
+        if (storage == FSIV_STORE_F16)
+            out = recursive_dog_sharpening<cv::float16_t>(in, r1, r2, circular);
+        else if (storage == FSIV_STORE_S16)
+            out = recursive_dog_sharpening<short>(in, r1, r2, circular);
+        else
+            out = recursive_dog_sharpening<float>(in, r1, r2, circular);
+    } else if (filter_type <= 1) {
+        out = lap_sharpening_8u(in, filter_type == 1, circular);
     } else {
-        aux = fsiv_extend_image(in, new_size, circular);
-        cv::filter2D(aux, out, -1, filter);
-        out = out(cv::Rect(filter.cols/2, filter.rows/2, in.cols, in.rows)).clone();
+        const cv::Mat filter = fsiv_get_kernel(FSIV_LAP4_KERNEL + filter_type, r1, r2)->kernel;
+        out = dog_sharpening_8u(in, filter, circular);
     }
 
     //
@@ -1,6 +1,59 @@
 #pragma once
+#include <memory>
 #include <opencv2/core.hpp>
 
+/**
+ * @brief Kernel types kept by the kernel cache.
+ */
+enum
+{
+    FSIV_GAUSSIAN_KERNEL=1,
+    FSIV_LAP4_KERNEL=2,
+    FSIV_LAP8_KERNEL=3,
+    FSIV_DOG_KERNEL=4
+};
+
+/**
+ * @brief Storage types of the intermediate images.
+ * The arithmetic is always done in float, but the intermediate images can be
+ * stored with 16 bits to halve their memory traffic:
+ * FSIV_STORE_F16 is half float (relative error < 2^-11).
+ * FSIV_STORE_S16 is fixed point with 7 fractional bits (abs error <= 2^-8),
+ * only for 8 bit images.
+ * Against FSIV_STORE_F32, the recursive DoG sharpening differs by at most one
+ * grey level with both (checked by bench_storage).
+ */
+enum
+{
+    FSIV_STORE_F32=0,
+    FSIV_STORE_F16=1,
+    FSIV_STORE_S16=2
+};
+
+/**
+ * @brief A filter kernel shared by the kernel cache.
+ * @warning it is shared by all the callers so it must not be modified.
+ */
+struct FilterKernel
+{
+    cv::Mat kernel;
+};
+
+/**
+ * @brief Get a kernel from the kernel cache.
+ * The kernel is built only the first time it is asked for. Later calls,
+ * from any thread, return the same shared kernel.
+ * @param type is the kernel type (FSIV_xxx_KERNEL).
+ * @param r1 is the Gaussian's radius, or the first Gaussian's radius for DoG.
+ * @param r2 is the second Gaussian's radius for DoG. Not used by the others.
+ * @return the shared kernel.
+ * @pre type is {FSIV_GAUSSIAN_KERNEL, FSIV_LAP4_KERNEL, FSIV_LAP8_KERNEL, FSIV_DOG_KERNEL}
+ * @pre type!=FSIV_GAUSSIAN_KERNEL || r1>0
+ * @pre type!=FSIV_DOG_KERNEL || 0<r1<r2
+ * @post ret_v->kernel.type()==CV_32FC1
+ */
+std::shared_ptr<const FilterKernel> fsiv_get_kernel(int type, int r1=1, int r2=2);
+
 /**
  * @brief Return a Gaussian filter.
  * @arg[in] r is the filter's radius.
@@ -12,6 +65,23 @@
  */
 cv::Mat fsiv_create_gaussian_filter(const int r);
 
+/**
+ * @brief Blur an image using a recursive (IIR) approximation of a Gaussian filter.
+ * The Young - van Vliet filter is used, so the cost per pixel does not depend
+ * on the radius. The sigma is the same used by fsiv_create_gaussian_filter(r).
+ * @param in is the input image.
+ * @param r is the radius of the equivalent Gaussian filter.
+ * @param circular if it is true, use circular extension, else zero padding.
+ * @return the blurred image.
+ * @pre !in.empty()
+ * @pre in.depth()==CV_32F
+ * @pre r>0
+ * @post ret_v.type()==in.type()
+ * @post ret_v.size()==in.size()
+ */
+cv::Mat fsiv_recursive_gaussian_blur(cv::Mat const& in, const int r,
+                                     bool circular=false);
+
 
 /**
  * @brief Extend an image centering on the result.
@@ -40,14 +110,25 @@ cv::Mat fsiv_create_sharpening_filter(const int filter_type, int r1=1, int r2=2)
 /**
  * @brief Do a sharpeing enhance to an image.
  * @param img is the input image.
- * @param filter_type is the sharpening filter to use: 0->LAP_4, 1->LAP_8, 2->DOG.
+ * @param filter_type is the sharpening filter to use: 0->LAP_4, 1->LAP_8, 2->DOG,
+ *  3->DOG using recursive Gaussians (approximated, but its cost does not depend on r1, r2).
  * @param only_luma if the input image is RGB only enhances the luma, else enhances all RGB channels.
+ *  The luma is the HSV value V = max(B,G,R). It is sharpened while it is
+ *  streamed through a ring buffer of rows and each pixel is scaled by V'/V,
+ *  so no HSV conversion is done and the cost is close to the gray one.
  * @param r1 if filter type is DOG, is the radius of first Gaussian filter.
  * @param r2 if filter type is DOG, is the radius of second Gaussian filter.
  * @param circular if it is true, use circular convolution.
+ * @param storage is the storage type of the intermediate images (FSIV_STORE_xxx).
+ *  Only filter_type 3 keeps float intermediate images.
  * @return the enahance image.
- * @pre filter_type in {0,1,2}.
+ * @note LAP_4 and LAP_8 are computed in fixed point directly on the 8 bit data
+ *  (SIMD when available), giving the same result as the float convolution.
+ * @note DoG with r2<=7 uses a convolution specialized (unrolled) for the
+ *  kernel size, other radii use cv::filter2D().
+ * @pre filter_type in {0,1,2,3}.
  * @pre 0<r1<r2
+ * @pre storage in {FSIV_STORE_F32, FSIV_STORE_F16, FSIV_STORE_S16}
  */
 cv::Mat fsiv_image_sharpening(const cv::Mat& in, int filter_type, bool only_luma,
-                      int r1, int r2, bool circular);
+                      int r1, int r2, bool circular, int storage=FSIV_STORE_F32);
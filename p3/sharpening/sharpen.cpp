@@ -27,10 +27,11 @@ const char* keys =
     "{help h usage ? |      | print this message.}"
     "{i interactive  |      | Activate interactive mode.}"
     "{l luma         |      | process only \"luma\" if color image.}"
-    "{f filter       |0     | filter to use.}"
+    "{f filter       |0     | filter to use: 0->LAP_4, 1->LAP_8, 2->DoG, 3->DoG (recursive).}"
     "{r1             |1     | r1 for DoG filter.}"
     "{r2             |2     | r2 for DoG filter. (0<r1<r2)}"
     "{c circular     |      | use circular convolution.}"
+    "{s storage      |0     | storage of the intermediate images for DoG (recursive): 0->float, 1->half float, 2->16 bit fixed point.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}"
     ;
@@ -44,6 +45,7 @@ struct UserData
     int r1;
     int r2;
     int filter_type;
+    int storage;
 };
 
 void on_change_l(int v, void * user_data_)
@@ -52,7 +54,8 @@ void on_change_l(int v, void * user_data_)
     user_data->luma = v;
    if (user_data->r1 < user_data->r2)
         user_data->output = fsiv_image_sharpening(user_data->input, user_data->filter_type, 
-            user_data->luma, user_data->r1, user_data->r2, user_data->circular);
+            user_data->luma, user_data->r1, user_data->r2, user_data->circular,
+            user_data->storage);
     cv::imshow("OUTPUT",user_data->output);
 }
 
@@ -62,7 +65,8 @@ void on_change_f(int v, void * user_data_)
     user_data->filter_type = v;
    if (user_data->r1 < user_data->r2)
         user_data->output = fsiv_image_sharpening(user_data->input, user_data->filter_type, 
-            user_data->luma, user_data->r1, user_data->r2, user_data->circular);
+            user_data->luma, user_data->r1, user_data->r2, user_data->circular,
+            user_data->storage);
     cv::imshow("OUTPUT",user_data->output);
 }
 
@@ -72,7 +76,8 @@ void on_change_r1(int v, void * user_data_)
     user_data->r1 = v+1;
     if (user_data->r1 < user_data->r2)
         user_data->output = fsiv_image_sharpening(user_data->input, user_data->filter_type, 
-            user_data->luma, user_data->r1, user_data->r2, user_data->circular);
+            user_data->luma, user_data->r1, user_data->r2, user_data->circular,
+            user_data->storage);
     cv::imshow("OUTPUT",user_data->output);
 }
 
@@ -82,7 +87,8 @@ void on_change_r2(int v, void * user_data_)
     user_data->r2 = v+1;
     if (user_data->r1 < user_data->r2)
         user_data->output = fsiv_image_sharpening(user_data->input, user_data->filter_type, 
-            user_data->luma, user_data->r1, user_data->r2, user_data->circular);
+            user_data->luma, user_data->r1, user_data->r2, user_data->circular,
+            user_data->storage);
     cv::imshow("OUTPUT",user_data->output);
 }
 
@@ -92,7 +98,8 @@ void on_change_c(int v, void * user_data_)
     user_data->circular = v;
     if (user_data->r1 < user_data->r2)
         user_data->output = fsiv_image_sharpening(user_data->input, user_data->filter_type, 
-            user_data->luma, user_data->r1, user_data->r2, user_data->circular);
+            user_data->luma, user_data->r1, user_data->r2, user_data->circular,
+            user_data->storage);
     
     cv::imshow("OUTPUT",user_data->output);
 }
@@ -123,6 +130,7 @@ main (int argc, char* const* argv)
         user_data.r1 = parser.get<int>("r1");
         user_data.r2 = parser.get<int>("r2");
         user_data.filter_type = parser.get<int>("f");
+        user_data.storage = parser.get<int>("s");
         //
 
         if (!parser.check())
@@ -146,8 +154,8 @@ main (int argc, char* const* argv)
         if (parser.has("i")){
             cv::createTrackbar("Luma", "OUTPUT", nullptr, 1, on_change_l, &user_data);
             cv::setTrackbarPos("Luma", "OUTPUT", (user_data.luma)?1:0);
-            cv::createTrackbar("Filter [0, 2]", "OUTPUT", nullptr, 2, on_change_f, &user_data);
-            cv::setTrackbarPos("Filter [0, 2]", "OUTPUT", user_data.filter_type);
+            cv::createTrackbar("Filter [0, 3]", "OUTPUT", nullptr, 3, on_change_f, &user_data);
+            cv::setTrackbarPos("Filter [0, 3]", "OUTPUT", user_data.filter_type);
             cv::createTrackbar("R1 [1, 50]", "OUTPUT", nullptr, 49, on_change_r1, &user_data);
             cv::createTrackbar("R2 [1, 20]", "OUTPUT", nullptr, 49, on_change_r2, &user_data);
             cv::setTrackbarPos("R2 [1, 20]", "OUTPUT", user_data.r2+1);
@@ -157,7 +165,8 @@ main (int argc, char* const* argv)
         }
 
         user_data.output = fsiv_image_sharpening(user_data.input, user_data.filter_type, 
-            user_data.luma, user_data.r1, user_data.r2, user_data.circular);
+            user_data.luma, user_data.r1, user_data.r2, user_data.circular,
+            user_data.storage);
 
         //
 
@@ -0,0 +1,211 @@
+/*!
+  Benchmark of fsiv_filter2D().
+
+  Compares the convolution engine with the original per pixel
+  implementation (window clone + cv::multiply + cv::sum) for several kernel
+  sizes, reporting the time of both, the speedup and the max abs error.
+  It also checks the running sums box blur (fsiv_box_blur()) against the
+  convolution with the box filter, for both expansion modes, and times it
+  with big radii, where its cost must stay close to the r=1 one.
+  At last, it checks the 16 bit storage of the intermediate images of the
+  recursive Gaussian USM against the float storage, exiting with a failure
+  code when the error goes over the bounds stated in common_code.hpp.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <exception>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#include "common_code.hpp"
+
+const cv::String keys =
+    "{help h usage ? |      | print this message.}"
+    "{s size         |512   | Image size (size x size). Default 512.}"
+    "{R max_radius   |10    | Max kernel radius. Default 10.}"
+    ;
+
+// Max error of the 16 bit storage against FSIV_STORE_F32 (see common_code.hpp).
+const double STORE_MAX_ERROR_8U = 1.0;
+const double STORE_MAX_ERROR_F16 = 4e-4;
+
+// The original implementation, used as reference.
+cv::Mat
+reference_filter2D(cv::Mat const& in, cv::Mat const& filter)
+{
+    cv::Mat window, aux;
+    cv::Mat ret_v = cv::Mat::zeros(in.rows - (filter.rows - 1), in.cols - (filter.cols - 1), CV_32F);
+
+    for (int i = 0; i < in.rows - (filter.rows - 1); i++){
+        for (int j = 0; j < in.cols - (filter.cols - 1); j++){
+            window = in(cv::Rect(j, i, filter.cols, filter.rows)).clone();
+            cv::multiply(window, filter, aux);
+            float sum = cv::sum(aux)[0];
+            ret_v.at<float>(i, j) = sum;
+        }
+    }
+    return ret_v;
+}
+
+int
+main (int argc, char* const* argv)
+{
+    int retCode=EXIT_SUCCESS;
+
+    try {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark fsiv_filter2D().");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        const int size = parser.get<int>("s");
+        const int max_r = parser.get<int>("R");
+        if (!parser.check() || size<=2*max_r || max_r<1)
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+
+        cv::Mat in(size, size, CV_32FC1);
+        cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+
+        std::cout << std::setw(4) << "r"
+                  << std::setw(14) << "ref (ms)"
+                  << std::setw(14) << "new (ms)"
+                  << std::setw(10) << "speedup"
+                  << std::setw(14) << "max error" << std::endl;
+        const int radii[] = {1, 2, 3, 5, 7, 10, 15, 20, 30};
+        for (const int r : radii)
+        {
+            if (r > max_r)
+                break;
+            const cv::Mat filter = fsiv_create_gaussian_filter(r);
+
+            int64 t0 = cv::getTickCount();
+            const cv::Mat ref = reference_filter2D(in, filter);
+            const double t_ref = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+
+            t0 = cv::getTickCount();
+            const cv::Mat out = fsiv_filter2D(in, filter);
+            const double t_new = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+
+            std::cout << std::setw(4) << r
+                      << std::setw(14) << std::fixed << std::setprecision(2) << t_ref
+                      << std::setw(14) << t_new
+                      << std::setw(10) << std::setprecision(1) << t_ref/t_new
+                      << std::setw(14) << std::scientific << std::setprecision(2)
+                      << cv::norm(ref, out, cv::NORM_INF) << std::endl;
+        }
+
+        std::cout << std::endl << std::setw(4) << "r"
+                  << std::setw(10) << "circular"
+                  << std::setw(14) << "conv (ms)"
+                  << std::setw(14) << "box (ms)"
+                  << std::setw(14) << "max error" << std::endl;
+        for (const int r : radii)
+        {
+            if (r > max_r)
+                break;
+            const cv::Mat filter = fsiv_create_box_filter(r);
+            for (int circular = 0; circular < 2; ++circular)
+            {
+                int64 t0 = cv::getTickCount();
+                const cv::Mat expanded = circular ? fsiv_circular_expansion(in, r)
+                                                  : fsiv_fill_expansion(in, r);
+                const cv::Mat conv = fsiv_filter2D(expanded, filter);
+                const double t_conv = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+
+                t0 = cv::getTickCount();
+                const cv::Mat box = fsiv_box_blur(in, r, circular);
+                const double t_box = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+
+                std::cout << std::setw(4) << r
+                          << std::setw(10) << circular
+                          << std::setw(14) << std::fixed << std::setprecision(2) << t_conv
+                          << std::setw(14) << t_box
+                          << std::setw(14) << std::scientific << std::setprecision(2)
+                          << cv::norm(conv, box, cv::NORM_INF) << std::endl;
+            }
+        }
+
+        // The cost of the box blur must not grow with the radius, so it is
+        // also timed with radii too big for the convolution.
+        std::cout << std::endl << std::setw(4) << "r"
+                  << std::setw(14) << "box (ms)"
+                  << std::setw(14) << "vs r=1" << std::endl;
+        const int box_radii[] = {1, 10, 30, 100, 200};
+        double t_box1 = 0.0;
+        for (const int r : box_radii)
+        {
+            if (2*r >= size)
+                break;
+            const int64 t0 = cv::getTickCount();
+            const cv::Mat box = fsiv_box_blur(in, r, true);
+            const double t_box = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+            if (r == 1)
+                t_box1 = t_box;
+            std::cout << std::setw(4) << r
+                      << std::setw(14) << std::fixed << std::setprecision(2) << t_box
+                      << std::setw(14) << std::setprecision(1) << t_box/t_box1 << std::endl;
+        }
+
+        cv::Mat in8;
+        in.convertTo(in8, CV_8U, 255.0);
+        const char* storage_names[] = {"f32", "f16", "s16"};
+        std::cout << std::endl << std::setw(4) << "r"
+                  << std::setw(10) << "storage"
+                  << std::setw(14) << "8u (ms)"
+                  << std::setw(14) << "max error"
+                  << std::setw(14) << "32f (ms)"
+                  << std::setw(14) << "max error" << std::endl;
+        for (const int r : radii)
+        {
+            if (r > max_r)
+                break;
+            const cv::Mat ref8 = fsiv_usm_enhance(in8, 1.0, r, 2);
+            const cv::Mat ref32 = fsiv_usm_enhance(in, 1.0, r, 2);
+            for (int storage = FSIV_STORE_F32; storage <= FSIV_STORE_S16; ++storage)
+            {
+                int64 t0 = cv::getTickCount();
+                const cv::Mat out8 = fsiv_usm_enhance(in8, 1.0, r, 2, false,
+                                                      nullptr, storage);
+                const double t_8u = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+
+                std::cout << std::setw(4) << r
+                          << std::setw(10) << storage_names[storage]
+                          << std::setw(14) << std::fixed << std::setprecision(2) << t_8u
+                          << std::setw(14) << std::scientific << std::setprecision(2)
+                          << cv::norm(ref8, out8, cv::NORM_INF);
+                bool ok = cv::norm(ref8, out8, cv::NORM_INF) <= STORE_MAX_ERROR_8U;
+                // Fixed point storage is only for 8 bit images.
+                if (storage != FSIV_STORE_S16)
+                {
+                    t0 = cv::getTickCount();
+                    const cv::Mat out32 = fsiv_usm_enhance(in, 1.0, r, 2, false,
+                                                           nullptr, storage);
+                    const double t_32f = (cv::getTickCount()-t0)*1000.0/cv::getTickFrequency();
+                    std::cout << std::setw(14) << std::fixed << std::setprecision(2) << t_32f
+                              << std::setw(14) << std::scientific << std::setprecision(2)
+                              << cv::norm(ref32, out32, cv::NORM_INF);
+                    ok = ok && cv::norm(ref32, out32, cv::NORM_INF) <= STORE_MAX_ERROR_F16;
+                }
+                if (!ok)
+                {
+                    std::cout << "  FAIL";
+                    retCode = EXIT_FAILURE;
+                }
+                std::cout << std::endl;
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Capturada excepcion: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
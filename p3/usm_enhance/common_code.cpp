@@ -1,5 +1,739 @@
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#include <opencv2/core/utility.hpp>
 #include "common_code.hpp"
 
+namespace {
+
+// Working buffers of the recursive filters are sized to fit in L2.
+const size_t BLOCK_BYTES = 256*1024;
+
+// Working set of the direct convolution is sized to fit in L1.
+const size_t L1_BYTES = 32*1024;
+
+// Outputs of a convolution tile. They are accumulated in registers
+// (8 AVX or 16 SSE vectors) along the whole kernel.
+const int CONV_TILE = 64;
+
+// Width of the tiles run in parallel.
+const int TILE_COLS = 512;
+
+// Min size of a tile, in halos. Each tile filters its halo again, so with
+// tiles this big the extra work is bounded whatever the radius.
+const int MIN_TILE_HALOS = 4;
+
+size_t
+l2_cache_bytes()
+{
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    const long bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (bytes > 0)
+        return bytes;
+#endif
+    return BLOCK_BYTES;
+}
+
+// Split an image in tiles to be run in parallel. A tile and its halo fit
+// in half the L2 cache, but the tiles are at least MIN_TILE_HALOS halos
+// wide and tall, so for big radii they are bigger than the cache rather
+// than doing the halo many times. The grid only depends on the image and
+// the halo, never on the number of threads, so the results are the same
+// for any number of threads.
+std::vector<cv::Rect>
+make_tiles(cv::Size size, int halo, size_t elem_bytes)
+{
+    static const size_t l2 = l2_cache_bytes();
+    const int tw = std::min(size.width, std::max(TILE_COLS, MIN_TILE_HALOS*halo));
+    const int th = std::max(std::max(16, MIN_TILE_HALOS*halo),
+                            static_cast<int>(l2/2/((tw + 2*halo)*elem_bytes)) - 2*halo);
+    std::vector<cv::Rect> tiles;
+    for (int y = 0; y < size.height; y += th)
+        for (int x = 0; x < size.width; x += tw)
+            tiles.push_back(cv::Rect(x, y, std::min(tw, size.width - x),
+                                     std::min(th, size.height - y)));
+    return tiles;
+}
+
+// Output stage of the blurs. A plain blur stores the blurred values in out.
+// The fused USM stores a*in + b*blur in out instead, while the blurred row
+// is still in cache, and keeps a copy of the blur in mask only if it is not
+// empty.
+struct BlurOutput
+{
+    explicit BlurOutput(const cv::Mat& out_)
+        : out(out_), a(0.0f), b(1.0f)
+    {}
+    BlurOutput(const cv::Mat& out_, const cv::Mat& in_, float a_, float b_,
+               const cv::Mat& mask_)
+        : out(out_), in(in_), mask(mask_), a(a_), b(b_)
+    {}
+
+    BlurOutput
+    roi(const cv::Rect& r) const
+    {
+        BlurOutput o(*this);
+        o.out = out(r);
+        if (!in.empty())
+            o.in = in(r);
+        if (!mask.empty())
+            o.mask = mask(r);
+        return o;
+    }
+
+    // Store n blurred values from element x (column*channels) of row y.
+    void
+    store(int y, int x, const float* blur, int n)
+    {
+        if (out.depth() == CV_8U)
+            store_row<uchar>(y, x, blur, n);
+        else
+            store_row<float>(y, x, blur, n);
+    }
+
+    template<class T>
+    void
+    store_row(int y, int x, const float* blur, int n)
+    {
+        T* dst = out.ptr<T>(y) + x;
+        if (in.empty())
+        {
+            for (int i = 0; i < n; ++i)
+                dst[i] = cv::saturate_cast<T>(blur[i]);
+            return;
+        }
+        if (!mask.empty())
+        {
+            T* m = mask.ptr<T>(y) + x;
+            for (int i = 0; i < n; ++i)
+                m[i] = cv::saturate_cast<T>(blur[i]);
+        }
+        const T* src = in.ptr<T>(y) + x;
+        for (int i = 0; i < n; ++i)
+            dst[i] = cv::saturate_cast<T>(a*src[i] + b*blur[i]);
+    }
+
+    cv::Mat out;
+    cv::Mat in;
+    cv::Mat mask;
+    float a;
+    float b;
+};
+
+// Correlate n (N if N>0) consecutive outputs of a row. src points to the
+// input under the first output and step is the input row step in elements.
+// The pixels have cn interleaved channels, so the taps are cn elements
+// apart and all the channels are done by the same loads. The loop over the
+// outputs is innermost so each tap is broadcast and the tile is updated with
+// SIMD. 8 bit input is only widened to float in registers.
+// If KH and KW are not 0 they are the kernel size, known at compile time,
+// so the loops over the taps can be fully unrolled by the compiler.
+template<int N, int KH, int KW, class T>
+inline void
+conv_tile(const T* src, size_t step, const float* k, int kh, int kw, int cn,
+          BlurOutput& o, int y, int x0, int n)
+{
+    const int len = N > 0 ? N : n;
+    const int rows = KH > 0 ? KH : kh;
+    const int cols = KW > 0 ? KW : kw;
+    float acc[N > 0 ? N : CONV_TILE] = {0.0f};
+    for (int i = 0; i < rows; ++i)
+    {
+        const T* row = src + i*step;
+        const float* taps = k + i*cols;
+        for (int j = 0; j < cols; ++j)
+        {
+            const float t = taps[j];
+            const T* x = row + j*cn;
+            for (int o = 0; o < len; ++o)
+                acc[o] += t*x[o];
+        }
+    }
+    o.store(y, x0, acc, len);
+}
+
+// Valid correlation of in with k into o (o.out.size() == in.size() - k.size() + 1).
+// The output is done in blocks of rows and, inside a block, in column
+// strips of CONV_TILE outputs, so the (block+kh-1) input rows of a strip
+// stay in L1 while the block rows of the strip are done.
+// KH and KW are the kernel size if it is known at compile time, else 0.
+template<class T, int KH, int KW>
+void
+conv_block(const cv::Mat& in, const cv::Mat& k, BlurOutput o)
+{
+    const int cn = in.channels();
+    const cv::Size out(o.out.cols*cn, o.out.rows);
+    const int kh = KH > 0 ? KH : k.rows;
+    const int kw = KW > 0 ? KW : k.cols;
+    const size_t step = in.step1();
+    // The taps are copied to the stack, close to the accumulators.
+    float taps[KH > 0 && KW > 0 ? KH*KW : 1];
+    const float* kt = k.ptr<float>();
+    if (KH > 0 && KW > 0)
+    {
+        std::copy(kt, kt + KH*KW, taps);
+        kt = taps;
+    }
+    const int block = std::max<int>(1, L1_BYTES/((CONV_TILE+kw*cn)*sizeof(float)) - (kh-1));
+    for (int y0 = 0; y0 < out.height; y0 += block)
+    {
+        const int y1 = std::min(out.height, y0 + block);
+        for (int x0 = 0; x0 < out.width; x0 += CONV_TILE)
+        {
+            const int n = std::min(CONV_TILE, out.width - x0);
+            for (int y = y0; y < y1; ++y)
+            {
+                const T* src = in.ptr<T>(y) + x0;
+                if (n == CONV_TILE)
+                    conv_tile<CONV_TILE, KH, KW>(src, step, kt, kh, kw, cn, o, y, x0, n);
+                else
+                    conv_tile<0, KH, KW>(src, step, kt, kh, kw, cn, o, y, x0, n);
+            }
+        }
+    }
+}
+
+// Small square kernels (radius 1 to 7, the usual USM and sharpening
+// ones) use a conv_block() specialized for their size. Other kernels use
+// the generic one.
+template<class T>
+void
+conv_block_dispatch(const cv::Mat& in, const cv::Mat& k, const BlurOutput& o)
+{
+    if (k.rows == k.cols)
+    {
+        switch (k.rows)
+        {
+        case 3: conv_block<T, 3, 3>(in, k, o); return;
+        case 5: conv_block<T, 5, 5>(in, k, o); return;
+        case 7: conv_block<T, 7, 7>(in, k, o); return;
+        case 9: conv_block<T, 9, 9>(in, k, o); return;
+        case 11: conv_block<T, 11, 11>(in, k, o); return;
+        case 13: conv_block<T, 13, 13>(in, k, o); return;
+        case 15: conv_block<T, 15, 15>(in, k, o); return;
+        default: break;
+        }
+    }
+    conv_block<T, 0, 0>(in, k, o);
+}
+
+// As conv_block(), but the output is split in tiles run in parallel.
+template<class T>
+void
+conv_valid(const cv::Mat& in, const cv::Mat& k, const BlurOutput& out)
+{
+    const std::vector<cv::Rect> tiles =
+        make_tiles(out.out.size(), std::max(k.rows, k.cols)/2, in.channels()*sizeof(float));
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())),
+                      [&](const cv::Range& range)
+    {
+        for (int t = range.start; t < range.end; ++t)
+        {
+            const cv::Rect& tile = tiles[t];
+            conv_block_dispatch<T>(in(cv::Rect(tile.x, tile.y, tile.width + k.cols - 1,
+                                               tile.height + k.rows - 1)),
+                                   k, out.roi(tile));
+        }
+    });
+}
+
+// Young - van Vliet coefficients {B, b1/b0, b2/b0, b3/b0}.
+void
+yvv_coefficients(double sigma, float c[4])
+{
+    const double q = (sigma >= 2.5) ? 0.98711*sigma - 0.96330
+                                    : 3.97156 - 4.14554*std::sqrt(1.0 - 0.26891*sigma);
+    const double q2 = q*q;
+    const double q3 = q2*q;
+    const double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+    const double b1 = (2.44413*q + 2.85619*q2 + 1.26661*q3)/b0;
+    const double b2 = -(1.4281*q2 + 1.26661*q3)/b0;
+    const double b3 = 0.422205*q3/b0;
+    c[0] = 1.0 - (b1 + b2 + b3);
+    c[1] = b1;
+    c[2] = b2;
+    c[3] = b3;
+}
+
+// Forward and backward recursion over 'lanes' signals of length n stored
+// interleaved (sample i of lane l is at buf[(i+3)*lanes+l]). The three
+// samples before and after the signal must be zero. The inner loops run
+// across lanes so they are vectorized.
+void
+yvv_filter_lanes(float* buf, int n, int lanes, const float c[4])
+{
+    for (int i = 3; i < n+3; ++i)
+    {
+        float* x = buf + i*lanes;
+        const float* x1 = x - lanes;
+        const float* x2 = x1 - lanes;
+        const float* x3 = x2 - lanes;
+        for (int l = 0; l < lanes; ++l)
+            x[l] = c[0]*x[l] + c[1]*x1[l] + c[2]*x2[l] + c[3]*x3[l];
+    }
+    for (int i = n+2; i >= 3; --i)
+    {
+        float* x = buf + i*lanes;
+        const float* x1 = x + lanes;
+        const float* x2 = x1 + lanes;
+        const float* x3 = x2 + lanes;
+        for (int l = 0; l < lanes; ++l)
+            x[l] = c[0]*x[l] + c[1]*x1[l] + c[2]*x2[l] + c[3]*x3[l];
+    }
+}
+
+// Source index of each sample of a line of length n extended pad samples
+// per side. -1 means a zero sample.
+std::vector<int>
+border_table(int n, int pad, bool circular)
+{
+    std::vector<int> idx(n + 2*pad);
+    for (int i = 0; i < n + 2*pad; ++i)
+    {
+        int j = i - pad;
+        if (circular)
+            j = ((j % n) + n) % n;
+        else if (j < 0 || j >= n)
+            j = -1;
+        idx[i] = j;
+    }
+    return idx;
+}
+
+cv::Mat
+make_box_kernel(int r)
+{
+    cv::Mat k = cv::Mat::ones(2*r+1, 2*r+1, CV_32FC1);
+    cv::normalize(k, k, 1.0, 0.0, cv::NORM_L1);
+    return k;
+}
+
+cv::Mat
+make_gaussian_kernel(int r)
+{
+    float sigma = ((float)(2*r+1))/6.0;
+    cv::Mat k = cv::Mat::zeros(2*r+1, 2*r+1, CV_32F);
+
+    for (int i = r; i >= -r; --i){
+        for(int j = -r; j <= r; ++j){
+            float dividendo = - (std::pow(i, 2) + std::pow(j, 2));
+            float divisor = 2 * std::pow(sigma, 2);
+            k.at<float>(i+r, j+r) = std::exp(dividendo/divisor);
+        }
+    }
+
+    cv::normalize(k, k, 1.0, 0.0, cv::NORM_L1);
+    return k;
+}
+
+// The Gaussian is separable: G(i,j) = g(i)*g(j).
+cv::Mat
+make_gaussian_kernel_1d(int r)
+{
+    float sigma = ((float)(2*r+1))/6.0;
+    cv::Mat k(1, 2*r+1, CV_32FC1);
+    for (int i = -r; i <= r; ++i)
+        k.at<float>(0, i+r) = std::exp(-(i*i)/(2*sigma*sigma));
+    cv::normalize(k, k, 1.0, 0.0, cv::NORM_L1);
+    return k;
+}
+
+// Normalized 1D Gaussian (a row) of any sigma, truncated at 3 sigma.
+cv::Mat
+make_gaussian_kernel_sigma(double sigma)
+{
+    const int r = std::max(1, static_cast<int>(std::ceil(3.0*sigma)));
+    cv::Mat k(1, 2*r+1, CV_32FC1);
+    for (int i = -r; i <= r; ++i)
+        k.at<float>(0, i+r) = std::exp(-(i*i)/(2.0*sigma*sigma));
+    cv::normalize(k, k, 1.0, 0.0, cv::NORM_L1);
+    return k;
+}
+
+template<class T>
+void
+border_filter2D(const cv::Mat& in, const cv::Mat& k, bool circular,
+                const BlurOutput& out)
+{
+    CV_Assert(in.channels()<=4);
+    const int cn = in.channels();
+    const int rh = k.rows/2;
+    const int rw = k.cols/2;
+
+    // Interior: the window is inside the image, so no index is checked.
+    const int in_rows = in.rows - 2*rh;
+    const int in_cols = in.cols - 2*rw;
+    if (in_rows > 0 && in_cols > 0)
+    {
+        conv_valid<T>(in, k, out.roi(cv::Rect(rw, rh, in_cols, in_rows)));
+    }
+
+    // Margins: the samples are read through the border tables, where -1
+    // is a zero (padding) sample.
+    const std::vector<int> row_idx = border_table(in.rows, rh, circular);
+    const std::vector<int> col_idx = border_table(in.cols, rw, circular);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range& range)
+    {
+        BlurOutput o(out);
+        for (int y = range.start; y < range.end; ++y)
+        {
+            const bool margin_row = y < rh || y >= in.rows - rh || in_cols <= 0;
+            for (int x = 0; x < in.cols; ++x)
+            {
+                if (!margin_row && x == rw)
+                {
+                    x = in.cols - rw;
+                    if (x == in.cols)
+                        break;
+                }
+                float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+                for (int i = 0; i < k.rows; ++i)
+                {
+                    const int sy = row_idx[y+i];
+                    if (sy < 0)
+                        continue;
+                    const T* src = in.ptr<T>(sy);
+                    const float* taps = k.ptr<float>(i);
+                    for (int j = 0; j < k.cols; ++j)
+                    {
+                        const int sx = col_idx[x+j];
+                        if (sx >= 0)
+                            for (int c = 0; c < cn; ++c)
+                                acc[c] += taps[j]*src[sx*cn + c];
+                    }
+                }
+                o.store(y, x*cn, acc, cn);
+            }
+        }
+    });
+}
+
+template<class T>
+void
+box_blur(const cv::Mat& in, int r, bool circular, const BlurOutput& out)
+{
+    // Two passes of running sums. They are accumulated in double so the
+    // error does not grow along the lines. Each tile does both passes over
+    // itself and an r pixels halo, so the tiles are independent.
+    const int cn = in.channels();
+    const int d = 2*r + 1;
+    const double norm = 1.0/d;
+    const std::vector<int> row_idx = border_table(in.rows, r, circular);
+    const std::vector<int> col_idx = border_table(in.cols, r, circular);
+    const std::vector<cv::Rect> tiles = make_tiles(in.size(), r, cn*sizeof(float));
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())),
+                      [&](const cv::Range& range)
+    {
+        std::vector<float> tmp;
+        std::vector<double> hsum(cn);
+        std::vector<double> vsum;
+        std::vector<float> row;
+        for (int t = range.start; t < range.end; ++t)
+        {
+            const cv::Rect& tile = tiles[t];
+            const int width = tile.width*cn;
+            const int rows = tile.height + d - 1;
+
+            // Horizontal pass over the rows of the tile and its halo.
+            tmp.assign(rows*width, 0.0f);
+            for (int i = 0; i < rows; ++i)
+            {
+                if (row_idx[tile.y + i] < 0)
+                    continue;
+                const T* src = in.ptr<T>(row_idx[tile.y + i]);
+                const int* idx = &col_idx[tile.x];
+                float* dst = &tmp[i*width];
+                std::fill(hsum.begin(), hsum.end(), 0.0);
+                for (int j = 0; j < d-1; ++j)
+                    if (idx[j] >= 0)
+                        for (int k = 0; k < cn; ++k)
+                            hsum[k] += src[idx[j]*cn + k];
+                for (int x = 0; x < tile.width; ++x)
+                {
+                    const int add = idx[x+d-1];
+                    const int sub = idx[x];
+                    for (int k = 0; k < cn; ++k)
+                    {
+                        if (add >= 0)
+                            hsum[k] += src[add*cn + k];
+                        dst[x*cn + k] = static_cast<float>(hsum[k]*norm);
+                        if (sub >= 0)
+                            hsum[k] -= src[sub*cn + k];
+                    }
+                }
+            }
+
+            // Vertical pass: a row of column sums is updated with whole
+            // rows, so the loops run along the rows and are vectorized.
+            BlurOutput o = out.roi(tile);
+            vsum.assign(width, 0.0);
+            row.resize(width);
+            for (int i = 0; i < d-1; ++i)
+                for (int x = 0; x < width; ++x)
+                    vsum[x] += tmp[i*width + x];
+            for (int y = 0; y < tile.height; ++y)
+            {
+                const float* add = &tmp[(y+d-1)*width];
+                const float* sub = &tmp[y*width];
+                for (int x = 0; x < width; ++x)
+                {
+                    vsum[x] += add[x];
+                    row[x] = static_cast<float>(vsum[x]*norm);
+                    vsum[x] -= sub[x];
+                }
+                o.store(y, 0, row.data(), width);
+            }
+        }
+    });
+}
+
+// Blur with a separable kernel, given by its 1D factors row and col. Each
+// tile does a horizontal pass over itself and its halo into a float buffer
+// and then a vertical pass from the buffer, so a pixel costs 2*(2r+1) taps
+// instead of (2r+1)^2. Both passes run along the rows, on rows extended
+// through the border tables, so their loops are vectorized.
+template<class T>
+void
+separable_blur(const cv::Mat& in, const cv::Mat& row_k, const cv::Mat& col_k,
+               bool circular, const BlurOutput& out)
+{
+    CV_Assert(row_k.isContinuous() && col_k.isContinuous());
+    const int cn = in.channels();
+    const int d = row_k.total();
+    const int r = d/2;
+    const float* htaps = row_k.ptr<float>();
+    const float* vtaps = col_k.ptr<float>();
+    const std::vector<int> row_idx = border_table(in.rows, r, circular);
+    const std::vector<int> col_idx = border_table(in.cols, r, circular);
+    const std::vector<cv::Rect> tiles = make_tiles(in.size(), r, cn*sizeof(float));
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())),
+                      [&](const cv::Range& range)
+    {
+        std::vector<float> tmp;
+        std::vector<float> line;
+        std::vector<float> row;
+        for (int t = range.start; t < range.end; ++t)
+        {
+            const cv::Rect& tile = tiles[t];
+            const int width = tile.width*cn;
+            const int rows = tile.height + d - 1;
+
+            // Horizontal pass over the rows of the tile and its halo.
+            tmp.assign(rows*width, 0.0f);
+            line.resize((tile.width + d - 1)*cn);
+            for (int i = 0; i < rows; ++i)
+            {
+                if (row_idx[tile.y + i] < 0)
+                    continue;
+                const T* src = in.ptr<T>(row_idx[tile.y + i]);
+                const int* idx = &col_idx[tile.x];
+                for (int x = 0; x < tile.width + d - 1; ++x)
+                    for (int k = 0; k < cn; ++k)
+                        line[x*cn + k] = idx[x] < 0 ? 0.0f : src[idx[x]*cn + k];
+                float* dst = &tmp[i*width];
+                for (int j = 0; j < d; ++j)
+                {
+                    const float tap = htaps[j];
+                    const float* s = &line[j*cn];
+                    for (int x = 0; x < width; ++x)
+                        dst[x] += tap*s[x];
+                }
+            }
+
+            // Vertical pass.
+            BlurOutput o = out.roi(tile);
+            row.resize(width);
+            for (int y = 0; y < tile.height; ++y)
+            {
+                std::fill(row.begin(), row.end(), 0.0f);
+                for (int i = 0; i < d; ++i)
+                {
+                    const float tap = vtaps[i];
+                    const float* s = &tmp[(y+i)*width];
+                    for (int x = 0; x < width; ++x)
+                        row[x] += tap*s[x];
+                }
+                o.store(y, 0, row.data(), width);
+            }
+        }
+    });
+}
+
+// Storage of the intermediate images. The arithmetic is always in float.
+template<class S>
+struct Storage
+{
+    static float load(S v) { return v; }
+    static S save(float v) { return v; }
+};
+
+template<>
+struct Storage<cv::float16_t>
+{
+    static float load(cv::float16_t v) { return static_cast<float>(v); }
+    static cv::float16_t save(float v) { return cv::float16_t(v); }
+};
+
+// 16 bit fixed point with FIXED_BITS fractional bits, for 8 bit images.
+const int FIXED_BITS = 7;
+
+template<>
+struct Storage<short>
+{
+    static float load(short v) { return v*(1.0f/(1 << FIXED_BITS)); }
+    static short save(float v) { return cv::saturate_cast<short>(v*(1 << FIXED_BITS)); }
+};
+
+// Recursive Gaussian blur of in (samples of type T). The intermediate
+// image between the two passes is stored as S.
+template<class T, class S>
+void
+recursive_gaussian_blur(const cv::Mat& in, int r, bool circular,
+                        const BlurOutput& out)
+{
+    float c[4];
+    yvv_coefficients((2*r+1)/6.0, c);
+    const int cn = in.channels();
+    const int pad = 2*r + 4;
+    const int width = in.cols*cn;
+    std::vector<S> tmp(in.rows*width);
+
+    // Horizontal pass: a block of rows is transposed so each row is a lane.
+    // The blocks are run in parallel.
+    {
+        const std::vector<int> idx = border_table(in.cols, pad, circular);
+        const int len = static_cast<int>(idx.size());
+        const int block = std::max<int>(1, BLOCK_BYTES/((len+6)*cn*sizeof(float)));
+        cv::parallel_for_(cv::Range(0, (in.rows + block - 1)/block),
+                          [&](const cv::Range& range)
+        {
+            std::vector<float> buf;
+            for (int y0 = range.start*block; y0 < std::min(in.rows, range.end*block); y0 += block)
+            {
+                const int rows = std::min(block, in.rows - y0);
+                const int lanes = rows*cn;
+                buf.assign((len+6)*lanes, 0.0f);
+                for (int b = 0; b < rows; ++b)
+                {
+                    const T* src = in.ptr<T>(y0+b);
+                    for (int i = 0; i < len; ++i)
+                        if (idx[i] >= 0)
+                            for (int k = 0; k < cn; ++k)
+                                buf[(i+3)*lanes + b*cn + k] = src[idx[i]*cn + k];
+                }
+                yvv_filter_lanes(buf.data(), len, lanes, c);
+                for (int b = 0; b < rows; ++b)
+                {
+                    S* dst = &tmp[(y0+b)*width];
+                    for (int x = 0; x < in.cols; ++x)
+                        for (int k = 0; k < cn; ++k)
+                            dst[x*cn + k] = Storage<S>::save(buf[(x+pad+3)*lanes + b*cn + k]);
+                }
+            }
+        });
+    }
+
+    // Vertical pass: a strip of columns is processed at once, one lane per
+    // column, so the recursion is vectorized across the strip. The strips
+    // are run in parallel.
+    {
+        const std::vector<int> idx = border_table(in.rows, pad, circular);
+        const int len = static_cast<int>(idx.size());
+        const int strip = std::max<int>(8, (BLOCK_BYTES/((len+6)*sizeof(float))) & ~7);
+        cv::parallel_for_(cv::Range(0, (width + strip - 1)/strip),
+                          [&](const cv::Range& range)
+        {
+            BlurOutput o(out);
+            std::vector<float> buf;
+            for (int x0 = range.start*strip; x0 < std::min(width, range.end*strip); x0 += strip)
+            {
+                const int lanes = std::min(strip, width - x0);
+                buf.assign((len+6)*lanes, 0.0f);
+                for (int i = 0; i < len; ++i)
+                    if (idx[i] >= 0)
+                    {
+                        const S* src = &tmp[idx[i]*width + x0];
+                        for (int l = 0; l < lanes; ++l)
+                            buf[(i+3)*lanes + l] = Storage<S>::load(src[l]);
+                    }
+                yvv_filter_lanes(buf.data(), len, lanes, c);
+                for (int y = 0; y < in.rows; ++y)
+                    o.store(y, x0, buf.data() + (y+pad+3)*lanes, lanes);
+            }
+        });
+    }
+}
+
+// The blur of the USM, for input of type T. Only the recursive Gaussian
+// keeps a full size intermediate image, stored as given by storage.
+template<class T>
+void
+usm_blur(const cv::Mat& in, int r, int filter_type, bool circular,
+         int storage, const BlurOutput& out)
+{
+    if (filter_type == 0){
+        box_blur<T>(in, r, circular, out);
+    } else if (filter_type == 2){
+        if (storage == FSIV_STORE_F16)
+            recursive_gaussian_blur<T, cv::float16_t>(in, r, circular, out);
+        else if (storage == FSIV_STORE_S16)
+            recursive_gaussian_blur<T, short>(in, r, circular, out);
+        else
+            recursive_gaussian_blur<T, float>(in, r, circular, out);
+    } else {
+        // The kernel is symmetric, so there is no need to flip it to
+        // convolve. It is shared by the cache, so it must not be
+        // modified anyway. It is separable, so it is done in two passes.
+        const std::shared_ptr<const FilterKernel> filter =
+            fsiv_get_kernel(FSIV_GAUSSIAN_KERNEL, r);
+        separable_blur<T>(in, filter->row, filter->col, circular, out);
+    }
+}
+
+} // namespace
+
+std::shared_ptr<const FilterKernel>
+fsiv_get_kernel(int type, int r1, int r2)
+{
+    CV_Assert(type==FSIV_BOX_KERNEL || type==FSIV_GAUSSIAN_KERNEL);
+    CV_Assert(r1>0);
+    typedef std::tuple<int, int, int> Key;
+    static std::mutex mutex;
+    static std::map<Key, std::shared_ptr<const FilterKernel>> cache;
+    // The box and the Gaussian kernels do not depend on r2.
+    r2 = 0;
+    const Key key(type, r1, r2);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+    }
+
+    // Build it without holding the lock. If another thread wins the race
+    // its kernel is kept, so every caller sees the same one.
+    std::shared_ptr<FilterKernel> k = std::make_shared<FilterKernel>();
+    if (type == FSIV_BOX_KERNEL)
+        k->kernel = make_box_kernel(r1);
+    else
+    {
+        k->kernel = make_gaussian_kernel(r1);
+        k->row = make_gaussian_kernel_1d(r1);
+        k->col = k->row.reshape(1, k->row.cols);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache.insert(std::make_pair(key, k)).first->second;
+}
+
 cv::Mat
 fsiv_create_box_filter(const int r)
 {
@@ -7,8 +741,7 @@ fsiv_create_box_filter(const int r)
     cv::Mat ret_v;
     //TODO
 
-    ret_v = cv::Mat::ones(2*r+1, 2*r+1, CV_32FC1);
-    cv::normalize(ret_v, ret_v, 1.0, 0.0, cv::NORM_L1);
+    ret_v = fsiv_get_kernel(FSIV_BOX_KERNEL, r)->kernel.clone();
 
     //
     CV_Assert(ret_v.type()==CV_32FC1);
@@ -24,18 +757,7 @@ fsiv_create_gaussian_filter(const int r)
     cv::Mat ret_v;
     //TODO: Remenber 6*sigma is approx 99,73% of the distribution.
 
-    float sigma = ((float)(2*r+1))/6.0;
-    ret_v = cv::Mat::zeros(2*r+1, 2*r+1, CV_32F);
-
-    for (int i = r; i >= -r; --i){
-        for(int j = -r; j <= r; ++j){
-            float dividendo = - (std::pow(i, 2) + std::pow(j, 2));
-            float divisor = 2 * std::pow(sigma, 2);
-            ret_v.at<float>(i+r, j+r) = std::exp(dividendo/divisor);
-        }
-    }
-
-    cv::normalize(ret_v, ret_v, 1.0, 0.0, cv::NORM_L1);
+    ret_v = fsiv_get_kernel(FSIV_GAUSSIAN_KERNEL, r)->kernel.clone();
 
     //
     CV_Assert(ret_v.type()==CV_32FC1);
@@ -108,17 +830,8 @@ fsiv_filter2D(cv::Mat const& in, cv::Mat const& filter)
     cv::Mat ret_v;
     //TODO
 
-    cv::Mat window, aux;
     ret_v = cv::Mat::zeros(in.rows - (filter.rows - 1), in.cols - (filter.cols - 1), CV_32F);
-
-    for (int i = 0; i < in.rows - (filter.rows - 1); i++){
-        for (int j = 0; j < in.cols - (filter.cols - 1); j++){
-            window = in(cv::Rect(j, i, filter.cols, filter.rows)).clone();
-            cv::multiply(window, filter, aux);
-            float sum = cv::sum(aux)[0];
-            ret_v.at<float>(i, j) = sum;
-        }
-    }
+    conv_valid<float>(in, filter.isContinuous() ? filter : filter.clone(), BlurOutput(ret_v));
 
     //
     CV_Assert(ret_v.type()==CV_32FC1);
@@ -127,6 +840,52 @@ fsiv_filter2D(cv::Mat const& in, cv::Mat const& filter)
     return ret_v;
 }
 
+cv::Mat
+fsiv_border_filter2D(cv::Mat const& in, cv::Mat const& filter, bool circular)
+{
+    CV_Assert(!in.empty() && !filter.empty());
+    CV_Assert(in.type()==CV_32FC1 && filter.type()==CV_32FC1);
+    CV_Assert(filter.rows%2==1 && filter.cols%2==1);
+    cv::Mat ret_v(in.size(), CV_32FC1);
+
+    border_filter2D<float>(in, filter.isContinuous() ? filter : filter.clone(),
+                           circular, BlurOutput(ret_v));
+
+    CV_Assert(ret_v.type()==CV_32FC1);
+    CV_Assert(ret_v.size()==in.size());
+    return ret_v;
+}
+
+cv::Mat
+fsiv_box_blur(cv::Mat const& in, const int r, bool circular)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.depth()==CV_32F);
+    CV_Assert(r>0);
+    cv::Mat ret_v(in.size(), in.type());
+
+    box_blur<float>(in, r, circular, BlurOutput(ret_v));
+
+    CV_Assert(ret_v.type()==in.type());
+    CV_Assert(ret_v.size()==in.size());
+    return ret_v;
+}
+
+cv::Mat
+fsiv_recursive_gaussian_blur(cv::Mat const& in, const int r, bool circular)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.depth()==CV_32F);
+    CV_Assert(r>0);
+    cv::Mat ret_v(in.size(), in.type());
+
+    recursive_gaussian_blur<float, float>(in, r, circular, BlurOutput(ret_v));
+
+    CV_Assert(ret_v.type()==in.type());
+    CV_Assert(ret_v.size()==in.size());
+    return ret_v;
+}
+
 cv::Mat
 fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
                     double a, double b)
@@ -148,44 +907,121 @@ fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
 
 cv::Mat
 fsiv_usm_enhance(cv::Mat  const& in, double g, int r,
-                 int filter_type, bool circular, cv::Mat *unsharp_mask)
+                 int filter_type, bool circular, cv::Mat *unsharp_mask,
+                 int storage)
 {
     CV_Assert(!in.empty());
-    CV_Assert(in.type()==CV_32FC1);
+    CV_Assert(in.depth()==CV_32F || in.depth()==CV_8U);
+    CV_Assert(in.channels()==1 || in.channels()==3);
     CV_Assert(r>0);
-    CV_Assert(filter_type>=0 && filter_type<=1);
+    CV_Assert(filter_type>=0 && filter_type<=2);
     CV_Assert(g>=0.0);
+    CV_Assert(FSIV_STORE_F32<=storage && storage<=FSIV_STORE_S16);
+    CV_Assert(storage!=FSIV_STORE_S16 || in.depth()==CV_8U);
     cv::Mat ret_v;
     //TODO
     //Hint: use your own functions fsiv_xxxx
 
-    cv::Mat expanded, imgLow, filter;
-    if (unsharp_mask == nullptr){
-        unsharp_mask = &imgLow;
+    // The blur and the combination (g+1)*in - g*blur are fused: each
+    // blurred row is combined while it is in cache. The blurred image is
+    // only written if the caller asks for it. Colour images are processed
+    // with their channels interleaved.
+    ret_v.create(in.size(), in.type());
+    cv::Mat mask;
+    if (unsharp_mask != nullptr){
+        unsharp_mask->create(in.size(), in.type());
+        mask = *unsharp_mask;
     }
+    const BlurOutput out(ret_v, in, g+1, -g, mask);
 
-    if (filter_type == 0){
-        filter = fsiv_create_box_filter(r);
-    } else {
-        filter = fsiv_create_gaussian_filter(r);
-    }
-
-    if (circular) {
-        expanded = fsiv_circular_expansion(in, r);
-        cv::flip(filter, filter, -1);
-        *unsharp_mask = fsiv_filter2D(expanded, filter);
-        ret_v = fsiv_combine_images(in, *unsharp_mask, g+1, -g);
-
-    } else {
-        expanded = fsiv_fill_expansion(in, r);
-        cv::flip(filter, filter, -1);
-        *unsharp_mask = fsiv_filter2D(expanded, filter);
-        ret_v = fsiv_combine_images(in, *unsharp_mask, g+1, -g);
-    }
+    if (in.depth() == CV_8U)
+        usm_blur<uchar>(in, r, filter_type, circular, storage, out);
+    else
+        usm_blur<float>(in, r, filter_type, circular, storage, out);
 
     //
     CV_Assert(ret_v.rows==in.rows);
     CV_Assert(ret_v.cols==in.cols);
+    CV_Assert(ret_v.type()==in.type());
+    return ret_v;
+}
+
+cv::Mat
+fsiv_multiscale_usm_enhance(cv::Mat const& in,
+                            std::vector<std::pair<int, double>> const& scales,
+                            bool circular)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.type()==CV_32FC1);
+    CV_Assert(!scales.empty());
+    cv::Mat ret_v;
+
+    // From the smallest to the largest radius, so each Gaussian is derived
+    // from the previous one: G[s1]*G[d] = G[s2] with d^2 = s2^2 - s1^2.
+    std::vector<std::pair<int, double>> sorted(scales);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<cv::Mat> kernels(sorted.size());
+    std::vector<float> gains(sorted.size());
+    double a = 1.0;
+    double sigma = 0.0;
+    int pad = 0;
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        CV_Assert(sorted[i].first>0);
+        CV_Assert(sorted[i].second>=0.0);
+        const double s = (2*sorted[i].first+1)/6.0;
+        if (s > sigma)
+        {
+            kernels[i] = make_gaussian_kernel_sigma(std::sqrt(s*s - sigma*sigma));
+            pad += kernels[i].cols/2;
+            sigma = s;
+        }
+        gains[i] = static_cast<float>(sorted[i].second);
+        a += sorted[i].second;
+    }
+
+    // With zero padding, the blurs are done on an image expanded by the
+    // whole support, else what each one spreads out of the image would be
+    // lost for the next one.
+    const cv::Rect roi = circular ? cv::Rect(0, 0, in.cols, in.rows)
+                                  : cv::Rect(pad, pad, in.cols, in.rows);
+    cv::Mat blur = circular ? in : fsiv_fill_expansion(in, pad);
+    std::vector<cv::Mat> blurs;
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        if (!kernels[i].empty())
+        {
+            // Separable, so it is a row pass and a column pass.
+            cv::Mat tmp(blur.size(), CV_32FC1);
+            border_filter2D<float>(blur, kernels[i], circular, BlurOutput(tmp));
+            blur = cv::Mat(tmp.size(), CV_32FC1);
+            border_filter2D<float>(tmp, kernels[i].reshape(1, kernels[i].cols),
+                                   circular, BlurOutput(blur));
+        }
+        blurs.push_back(blur(roi));
+    }
+
+    // ret_v = (1+sum(g_i))*in - sum(g_i*G_i).
+    ret_v.create(in.size(), CV_32FC1);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range& range)
+    {
+        for (int y = range.start; y < range.end; ++y)
+        {
+            const float* src = in.ptr<float>(y);
+            float* dst = ret_v.ptr<float>(y);
+            for (int x = 0; x < in.cols; ++x)
+                dst[x] = static_cast<float>(a)*src[x];
+            for (size_t i = 0; i < blurs.size(); ++i)
+            {
+                const float* b = blurs[i].ptr<float>(y);
+                const float g = gains[i];
+                for (int x = 0; x < in.cols; ++x)
+                    dst[x] -= g*b[x];
+            }
+        }
+    });
+
+    CV_Assert(ret_v.size()==in.size());
     CV_Assert(ret_v.type()==CV_32FC1);
     return ret_v;
 }
@@ -1,6 +1,65 @@
 #pragma once
+#include <memory>
+#include <utility>
+#include <vector>
 #include <opencv2/core.hpp>
 
+/**
+ * @brief Kernel types kept by the kernel cache.
+ */
+enum
+{
+    FSIV_BOX_KERNEL=0,
+    FSIV_GAUSSIAN_KERNEL=1
+};
+
+/**
+ * @brief Storage types of the intermediate images.
+ * The arithmetic is always done in float, but the intermediate images can be
+ * stored with 16 bits to halve their memory traffic:
+ * FSIV_STORE_F16 is half float (relative error < 2^-11).
+ * FSIV_STORE_S16 is fixed point with 7 fractional bits (abs error <= 2^-8),
+ * only for 8 bit images.
+ * Against FSIV_STORE_F32, the recursive Gaussian USM (g=1) of an 8 bit image
+ * differs by at most one grey level with both, and of a float image in [0,1]
+ * by less than 4e-4 with FSIV_STORE_F16 (checked by bench_filter2D).
+ */
+enum
+{
+    FSIV_STORE_F32=0,
+    FSIV_STORE_F16=1,
+    FSIV_STORE_S16=2
+};
+
+/**
+ * @brief A filter kernel shared by the kernel cache.
+ * For the Gaussian kernels kernel == col * row, and the USM blur uses row and
+ * col to filter in two passes. For the box kernels they are empty (the box
+ * blur uses running sums).
+ * @warning it is shared by all the callers so it must not be modified.
+ */
+struct FilterKernel
+{
+    cv::Mat kernel;
+    cv::Mat row;
+    cv::Mat col;
+};
+
+/**
+ * @brief Get a kernel from the kernel cache.
+ * The kernel is built only the first time it is asked for. Later calls,
+ * from any thread, return the same shared kernel.
+ * @arg[in] type is the kernel type: FSIV_BOX_KERNEL or FSIV_GAUSSIAN_KERNEL.
+ * @arg[in] r1 is the filter's radius.
+ * @arg[in] r2 is not used by these kernel types.
+ * @return the shared kernel.
+ * @pre type is {FSIV_BOX_KERNEL, FSIV_GAUSSIAN_KERNEL}
+ * @pre r1>0
+ * @post ret_v->kernel.type()==CV_32FC1
+ * @post ret_v->kernel.rows==ret_v->kernel.cols==2*r1+1
+ */
+std::shared_ptr<const FilterKernel> fsiv_get_kernel(int type, int r1, int r2=0);
+
 /**
  * @brief Return a box filter.
  * @arg[in] r is the filter's radius.
@@ -62,9 +121,61 @@ cv::Mat fsiv_circular_expansion(cv::Mat const& in, const int r);
  * @post ret.type()==CV_32FC1
  * @post ret.rows == in.rows-2*(filters.rows/2)
  * @post ret.cols == in.cols-2*(filters.cols/2)
+ * @note it runs in parallel over cache sized tiles (cv::parallel_for_).
+ *  Square kernels of radius 1 to 7 use code specialized for their size.
  */
 cv::Mat fsiv_filter2D(cv::Mat const& in, cv::Mat const& filter);
 
+/**
+ * @brief Correlate an image with a filter, extending the image on the fly.
+ * The result is the same as fsiv_filter2D() of the expanded image, but the
+ * expanded copy is not made: only the margins read the samples through
+ * (zero or circular) index tables.
+ * @arg[in] in is the input image.
+ * @arg[in] filter is the filter to be applied.
+ * @arg[in] circular if it is true, use circular expansion, else zero padding.
+ * @pre !in.empty() && !filter.empty()
+ * @pre in.type()==CV_32FC1 && filter.type()==CV_32FC1.
+ * @pre filter.rows and filter.cols are odd.
+ * @post ret.type()==CV_32FC1
+ * @post ret.size()==in.size()
+ */
+cv::Mat fsiv_border_filter2D(cv::Mat const& in, cv::Mat const& filter,
+                             bool circular=false);
+
+/**
+ * @brief Blur an image with a box filter using running sums.
+ * The cost per pixel does not depend on the radius. The result is the same
+ * as correlating the expanded image with fsiv_create_box_filter(r).
+ * @arg[in] in is the input image.
+ * @arg[in] r is the window's radius.
+ * @arg[in] circular if it is true, use circular expansion, else zero padding.
+ * @return the blurred image.
+ * @pre !in.empty()
+ * @pre in.depth()==CV_32F
+ * @pre r>0
+ * @post ret_v.type()==in.type()
+ * @post ret_v.size()==in.size()
+ */
+cv::Mat fsiv_box_blur(cv::Mat const& in, const int r, bool circular=false);
+
+/**
+ * @brief Blur an image using a recursive (IIR) approximation of a Gaussian filter.
+ * The Young - van Vliet filter is used, so the cost per pixel does not depend
+ * on the radius. The sigma is the same used by fsiv_create_gaussian_filter(r).
+ * @arg[in] in is the input image.
+ * @arg[in] r is the radius of the equivalent Gaussian filter.
+ * @arg[in] circular if it is true, use circular expansion, else zero padding.
+ * @return the blurred image.
+ * @pre !in.empty()
+ * @pre in.depth()==CV_32F
+ * @pre r>0
+ * @post ret_v.type()==in.type()
+ * @post ret_v.size()==in.size()
+ */
+cv::Mat fsiv_recursive_gaussian_blur(cv::Mat const& in, const int r,
+                                     bool circular=false);
+
 /**
  * @brief Combine two images using weigths.
  * @param src1 first image.
@@ -83,20 +194,58 @@ cv::Mat fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
                             double a, double b);
 /**
  * @brief Apply an unsharp mask enhance to the input image.
- * @arg[in] in is the input image.
+ * @arg[in] in is the input image. Colour images are enhanced channel by channel,
+ *  but with the channels interleaved: there are no per channel buffers and
+ *  8 bit images are converted to float only in the registers.
  * @arg[in] g is the enhance's gain.
  * @arg[in] r is the window's radius.
- * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian,
+ *  2->Recursive Gaussian (approximated, but its cost does not depend on r).
  * @arg[in] circular specifies if it is true, it be used circular expansion to do the convolution, else it is used zero padding.
- * @arg[out] unsharp_mask if it is not nullptr, save the unsharp mask used.
+ * @arg[out] unsharp_mask if it is not nullptr, save the unsharp mask used
+ *  (with the same type as in).
+ *  The blur is fused with the combination, so the mask is only written when
+ *  it is asked for.
+ * @arg[in] storage is the storage type of the intermediate images
+ *  (FSIV_STORE_xxx). Only filter_type 2 keeps a full size intermediate image.
+ * @note it runs in parallel over cache sized tiles (cv::parallel_for_). The
+ *  tiles do not depend on the number of threads, nor does the result.
  * @pre !in.empty()
- * @pre in.type()==CV_32FC1
+ * @pre in.type() is {CV_32FC1, CV_32FC3, CV_8UC1, CV_8UC3}
  * @pre g>=0.0
  * @pre r>0
- * @pre filter_type is {0, 1}
+ * @pre filter_type is {0, 1, 2}
+ * @pre storage is {FSIV_STORE_F32, FSIV_STORE_F16, FSIV_STORE_S16}
+ * @pre storage!=FSIV_STORE_S16 || in.depth()==CV_8U
  * @post ret_v.rows==in.rows && ret_v.cols==in.cols
- * @post ret_v.type()==CV_32FC1
+ * @post ret_v.type()==in.type()
  */
 cv::Mat fsiv_usm_enhance(cv::Mat  const& in, double g=1.0, int r=1,
                          int filter_type=0, bool circular=false,
-                         cv::Mat* unsharp_mask=nullptr);
+                         cv::Mat* unsharp_mask=nullptr,
+                         int storage=FSIV_STORE_F32);
+
+/**
+ * @brief Apply several unsharp mask enhances, at different scales, at once.
+ * The result is in + sum_i(g_i*(in - G[r_i]*in)), that is, the input plus
+ * the detail added by each fsiv_usm_enhance(in, g_i, r_i) with Gaussian
+ * filter. The Gaussians are built incrementally, each one blurring the
+ * previous one with a Gaussian of sigma^2 = sigma_i^2 - sigma_{i-1}^2, so
+ * the cost is well below N separate enhances. All the contributions are
+ * added in one final pass.
+ * @arg[in] in is the input image.
+ * @arg[in] scales is the list of (r, g) pairs: radius and gain of each scale.
+ * @arg[in] circular if it is true, use circular expansion, else zero padding.
+ * @return the enhanced image.
+ * @warning with zero padding the incremental Gaussians are slightly
+ *  different to the direct ones near the borders.
+ * @pre !in.empty()
+ * @pre in.type()==CV_32FC1
+ * @pre !scales.empty()
+ * @pre for each scale: r>0 and g>=0.0
+ * @post ret_v.size()==in.size()
+ * @post ret_v.type()==CV_32FC1
+ */
+cv::Mat fsiv_multiscale_usm_enhance(cv::Mat const& in,
+                                    std::vector<std::pair<int, double>> const& scales,
+                                    bool circular=false);
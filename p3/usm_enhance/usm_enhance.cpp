@@ -27,7 +27,7 @@ const cv::String keys =
     "{r radius       |1     | Window's radius. Default 1.}"
     "{g gain         |1.0   | Enhance's gain. Default 1.0}"
     "{c circular     |      | Use circular convolution.}"
-    "{f filter       |0     | Filter type: 0->Box, 1->Gaussian. Default 0.}"
+    "{f filter       |0     | Filter type: 0->Box, 1->Gaussian, 2->Recursive Gaussian. Default 0.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}"
     ;
@@ -40,7 +40,7 @@ struct UserData
     cv::Mat mask;
     int g;
     int r;
-    bool filter_type;
+    int filter_type;
     bool circular;
 };
 
@@ -210,8 +210,8 @@ main (int argc, char* const* argv)
             cv::setTrackbarPos("G [0 - 20]", "OUTPUT", user_data.g);
             cv::createTrackbar("R [1, 20]", "OUTPUT", nullptr, 19, on_change_r, &user_data);
             cv::setTrackbarPos("R [1, 20]", "OUTPUT", user_data.r);
-            cv::createTrackbar("F", "OUTPUT", nullptr, 1, on_change_f, &user_data);
-            cv::setTrackbarPos("F", "OUTPUT", (user_data.filter_type) ? 1 : 0);
+            cv::createTrackbar("F", "OUTPUT", nullptr, 2, on_change_f, &user_data);
+            cv::setTrackbarPos("F", "OUTPUT", user_data.filter_type);
             cv::createTrackbar("C", "OUTPUT", nullptr, 1, on_change_c, &user_data);
             cv::setTrackbarPos("C", "OUTPUT", (user_data.circular) ? 1 : 0);
         }
@@ -107,13 +107,11 @@ main (int argc, char* const* argv)
 
         //TODO
         //Load camera calibration parameters.
-        cv::FileStorage fs(intrinsics_file, cv::FileStorage::READ);
         cv::Size camera_size;
         float error;
         cv::Mat camera_matrix, dist_coeffs, rvec, tvec;
-        fsiv_load_calibration_parameters(fs, camera_size, error,
+        fsiv_load_calibration_parameters(intrinsics_file, camera_size, error,
             camera_matrix, dist_coeffs, rvec, tvec);
-        fs.release();
         //
 
 
@@ -139,14 +137,21 @@ main (int argc, char* const* argv)
         int wait_time = (is_camera ? 20 : 1000.0/25.0); //for a video file we use 25fps.
         int key = 0;
 
+        // The board is tracked from frame to frame, and only searched in
+        // the whole frame when the track is lost.
+        BoardTracker tracker(board_size);
+        tracker.set_camera(points3d, camera_matrix, dist_coeffs);
+        // The pose of each frame is warm started from the last one.
+        PoseEstimator pose_estimator;
+
         while (key!=27 && !input_frame.empty())
         {            
             //TODO
 
-            if(fsiv_find_chessboard_corners(input_frame, board_size,
-                points2d)){
-                fsiv_compute_camera_pose(points3d, points2d, camera_matrix,
+            if(tracker.find(input_frame, points2d)){
+                pose_estimator.estimate(points3d, points2d, camera_matrix,
                     dist_coeffs, rvec, tvec);
+                tracker.set_pose(rvec, tvec);
                 if (!projected_image.empty()){
                     fsiv_project_image(projected_image, input_frame, board_size, points2d);
                 } else if (projected_video.isOpened()){
@@ -1,9 +1,142 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/calib3d.hpp>
+#include <opencv2/video/tracking.hpp>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "common_code.hpp"
 
+namespace {
+
+// The binary calibration file (see the calibrate program) is this header
+// and then, if map_rows>0, the raw rows of the undistortion maps. All the
+// values are in the host byte order. The checksum is the FNV-1a hash of
+// the header, with the checksum set to 0, and of the maps.
+const char CALIB_MAGIC[8] = {'F', 'S', 'I', 'V', 'C', 'A', 'L', 'B'};
+const uint32_t CALIB_VERSION = 1;
+
+struct CalibFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t width, height;
+    double error;
+    double camera_matrix[9];
+    double dist_coeffs[5];
+    double rvec[3];
+    double tvec[3];
+    int32_t map_rows, map_cols;
+    int32_t map1_type, map2_type;
+    int32_t map_interp, reserved;
+    uint64_t maps_size;
+    uint64_t checksum;
+};
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t
+fnv1a(const void* data, size_t n, uint64_t h=FNV_OFFSET)
+{
+    const uchar* p = static_cast<const uchar*>(data);
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+uint64_t
+calib_checksum(CalibFileHeader header, const uchar* maps, size_t maps_size)
+{
+    header.checksum = 0;
+    return fnv1a(maps, maps_size, fnv1a(&header, sizeof(header)));
+}
+
+// A read only memory mapping of a whole file. It is empty if the file
+// could not be mapped.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& fname)
+        : data_(nullptr), size_(0)
+    {
+        const int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data_ = static_cast<const uchar*>(p);
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile()
+    {
+        if (data_ != nullptr)
+            ::munmap(const_cast<uchar*>(data_), size_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uchar* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uchar* data_;
+    size_t size_;
+};
+
+// Optical flow parameters of the board tracker and refinement of the
+// tracked corners.
+const int TRACK_WIN = 21;
+const int TRACK_LEVELS = 3;
+const int TRACK_SUBPIX_WIN = 3;
+
+// Search of the board around its predicted position: padding of the crops
+// (relative to the predicted board size), largest side of the searched
+// image and number of frames a pose is used to predict.
+const double ROI_PAD = 0.25;
+const double ROI_WIDE_PAD = 1.0;
+const int ROI_MIN_PAD = 16;
+const int ROI_MAX_SIDE = 480;
+const int ROI_MAX_FRAMES = 10;
+
+// Stop criterion of the warm started pose refinement and reprojection
+// error (pixels) below which an error jump is not a reason to start cold.
+const double POSE_EPS = 1e-6;
+const float POSE_MIN_COLD_ERROR = 0.5f;
+
+float
+reprojection_error(const std::vector<cv::Point3f>& _3dpoints,
+                   const std::vector<cv::Point2f>& _2dpoints,
+                   const cv::Mat& camera_matrix, const cv::Mat& dist_coeffs,
+                   const cv::Mat& rvec, const cv::Mat& tvec)
+{
+    std::vector<cv::Point2f> projected;
+    cv::projectPoints(_3dpoints, rvec, tvec, camera_matrix, dist_coeffs, projected);
+    double sq_error = 0.0;
+    for (size_t i = 0; i < projected.size(); ++i)
+    {
+        const cv::Point2f d = projected[i] - _2dpoints[i];
+        sq_error += d.dot(d);
+    }
+    return float(std::sqrt(sq_error / projected.size()));
+}
+
+} // namespace
+
 std::vector<cv::Point3f>
 fsiv_generate_3d_calibration_points(const cv::Size& board_size,
                                     float square_size)
@@ -53,6 +186,183 @@ fsiv_find_chessboard_corners(const cv::Mat& img, const cv::Size &board_size,
 }
 
 
+BoardTracker::BoardTracker(const cv::Size& board_size, double max_residual)
+    : board_size_(board_size), max_residual_(max_residual), tracked_(false),
+      frames_since_pose_(0)
+{
+    CV_Assert(board_size.width>1 && board_size.height>1);
+    CV_Assert(max_residual>0.0);
+    for (int i = 0; i < board_size.height; ++i)
+        for (int j = 0; j < board_size.width; ++j)
+            board_points_.push_back(cv::Point2f(j, i));
+}
+
+bool
+BoardTracker::find(const cv::Mat& frame, std::vector<cv::Point2f>& corner_points)
+{
+    CV_Assert(frame.type()==CV_8UC3);
+    cv::cvtColor(frame, gray_, cv::COLOR_BGR2GRAY);
+    cv::buildOpticalFlowPyramid(gray_, pyramid_, cv::Size(TRACK_WIN, TRACK_WIN),
+                                TRACK_LEVELS);
+
+    ++frames_since_pose_;
+    tracked_ = !prev_points_.empty() && track(corner_points);
+    bool found = tracked_;
+    if (!found)
+    {
+        // The whole frame is searched only if the search around the
+        // predicted board did not already do it.
+        const SearchResult result = search_predicted(frame, corner_points);
+        found = result == SEARCH_FOUND || (result == SEARCH_NOT_FOUND &&
+            fsiv_find_chessboard_corners(frame, board_size_, corner_points));
+    }
+
+    // The pyramid of this frame is the previous one of the next frame.
+    std::swap(prev_pyramid_, pyramid_);
+    if (found)
+        prev_points_ = corner_points;
+    else
+        prev_points_.clear();
+    return found;
+}
+
+bool
+BoardTracker::track(std::vector<cv::Point2f>& corner_points)
+{
+    std::vector<uchar> status;
+    std::vector<float> err;
+    cv::calcOpticalFlowPyrLK(prev_pyramid_, pyramid_, prev_points_, corner_points,
+                             status, err, cv::Size(TRACK_WIN, TRACK_WIN), TRACK_LEVELS);
+    for (const uchar s : status)
+        if (!s)
+            return false;
+
+    // The tracked corners must still be the projection of a plane grid.
+    const cv::Mat H = cv::findHomography(board_points_, corner_points);
+    if (H.empty())
+        return false;
+    std::vector<cv::Point2f> projected;
+    cv::perspectiveTransform(board_points_, projected, H);
+    double sq_residual = 0.0;
+    for (size_t i = 0; i < projected.size(); ++i)
+    {
+        const cv::Point2f d = projected[i] - corner_points[i];
+        sq_residual += d.dot(d);
+    }
+    if (sq_residual > max_residual_*max_residual_*projected.size())
+        return false;
+
+    cv::cornerSubPix(gray_, corner_points, cv::Size(TRACK_SUBPIX_WIN, TRACK_SUBPIX_WIN),
+                     cv::Size(-1, -1),
+                     cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
+                                      40, 0.001));
+    return true;
+}
+
+BoardTracker::SearchResult
+BoardTracker::search_predicted(const cv::Mat& frame, std::vector<cv::Point2f>& corner_points)
+{
+    if (points3d_.empty() || rvec_.empty() || frames_since_pose_ > ROI_MAX_FRAMES)
+        return SEARCH_NOT_FOUND;
+
+    // Constant velocity prediction from the last two poses.
+    cv::Mat rvec = rvec_, tvec = tvec_;
+    if (!prev_rvec_.empty())
+    {
+        rvec = rvec_ + double(frames_since_pose_) * (rvec_ - prev_rvec_);
+        tvec = tvec_ + double(frames_since_pose_) * (tvec_ - prev_tvec_);
+    }
+    std::vector<cv::Point2f> predicted;
+    cv::projectPoints(points3d_, rvec, tvec, camera_matrix_, dist_coeffs_, predicted);
+    const cv::Rect frame_rect(0, 0, frame.cols, frame.rows);
+    const cv::Rect board = cv::boundingRect(predicted);
+
+    for (const double pad : {ROI_PAD, ROI_WIDE_PAD})
+    {
+        const int pad_x = std::max(ROI_MIN_PAD, int(pad*board.width));
+        const int pad_y = std::max(ROI_MIN_PAD, int(pad*board.height));
+        const cv::Rect roi = cv::Rect(board.x - pad_x, board.y - pad_y,
+                                      board.width + 2*pad_x,
+                                      board.height + 2*pad_y) & frame_rect;
+        if (roi.width < board_size_.width || roi.height < board_size_.height)
+            return SEARCH_NOT_FOUND;
+
+        const double scale = std::min(1.0, double(ROI_MAX_SIDE) /
+                                      std::max(roi.width, roi.height));
+        cv::Mat search = frame(roi);
+        if (scale < 1.0)
+            cv::resize(frame(roi), search, cv::Size(), scale, scale, cv::INTER_AREA);
+        if (!cv::findChessboardCorners(search, board_size_, corner_points))
+        {
+            if (roi == frame_rect)
+                return scale < 1.0 ? SEARCH_NOT_FOUND : SEARCH_FRAME_NOT_FOUND;
+            continue;
+        }
+
+        // Back to frame coordinates, then refined at full resolution.
+        for (cv::Point2f& p : corner_points)
+            p = cv::Point2f(p.x/scale + roi.x, p.y/scale + roi.y);
+        const cv::TermCriteria criteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
+                                        40, 0.001);
+        if (scale < 1.0)
+        {
+            const int win = int(std::ceil(1.0/scale)) + 2;
+            cv::cornerSubPix(gray_, corner_points, cv::Size(win, win),
+                             cv::Size(-1, -1), criteria);
+        }
+        cv::cornerSubPix(gray_, corner_points, cv::Size(5, 5), cv::Size(-1, -1), criteria);
+        return SEARCH_FOUND;
+    }
+    return SEARCH_NOT_FOUND;
+}
+
+void
+BoardTracker::set_camera(const std::vector<cv::Point3f>& _3dpoints,
+                         const cv::Mat& camera_matrix,
+                         const cv::Mat& dist_coeffs)
+{
+    CV_Assert(_3dpoints.size()==size_t(board_size_.area()));
+    points3d_ = _3dpoints;
+    camera_matrix_ = camera_matrix.clone();
+    dist_coeffs_ = dist_coeffs.clone();
+}
+
+void
+BoardTracker::set_pose(const cv::Mat& rvec, const cv::Mat& tvec)
+{
+    // The velocity is only known between poses of consecutive frames.
+    if (!rvec_.empty() && frames_since_pose_ == 1)
+    {
+        prev_rvec_ = rvec_;
+        prev_tvec_ = tvec_;
+    }
+    else
+    {
+        prev_rvec_.release();
+        prev_tvec_.release();
+    }
+    rvec_ = rvec.clone();
+    tvec_ = tvec.clone();
+    frames_since_pose_ = 0;
+}
+
+bool
+BoardTracker::tracked() const
+{
+    return tracked_;
+}
+
+void
+BoardTracker::reset()
+{
+    prev_points_.clear();
+    tracked_ = false;
+    rvec_.release();
+    tvec_.release();
+    prev_rvec_.release();
+    prev_tvec_.release();
+}
+
 void fsiv_compute_camera_pose(const std::vector<cv::Point3f> &_3dpoints,
                               const std::vector<cv::Point2f> &_2dpoints,
                               const cv::Mat& camera_matrix,
@@ -70,6 +380,66 @@ void fsiv_compute_camera_pose(const std::vector<cv::Point3f> &_3dpoints,
     CV_Assert(tvec.rows==3 && tvec.cols==1 && tvec.type()==CV_64FC1);
 }
 
+PoseEstimator::PoseEstimator(int max_iters, double max_error_jump)
+    : max_iters_(max_iters), max_error_jump_(max_error_jump), error_(0.0f),
+      warm_(false)
+{
+    CV_Assert(max_iters>0 && max_error_jump>=1.0);
+}
+
+float
+PoseEstimator::estimate(const std::vector<cv::Point3f>& _3dpoints,
+                        const std::vector<cv::Point2f>& _2dpoints,
+                        const cv::Mat& camera_matrix,
+                        const cv::Mat& dist_coeffs,
+                        cv::Mat& rvec,
+                        cv::Mat& tvec)
+{
+    CV_Assert(_3dpoints.size()>=4 && _3dpoints.size()==_2dpoints.size());
+    float error = 0.0f;
+    warm_ = !rvec_.empty();
+    if (warm_)
+    {
+        rvec = rvec_.clone();
+        tvec = tvec_.clone();
+        cv::solvePnPRefineLM(_3dpoints, _2dpoints, camera_matrix, dist_coeffs,
+                             rvec, tvec,
+                             cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
+                                              max_iters_, POSE_EPS));
+        error = reprojection_error(_3dpoints, _2dpoints, camera_matrix,
+                                   dist_coeffs, rvec, tvec);
+        warm_ = error <= std::max(float(max_error_jump_*error_), POSE_MIN_COLD_ERROR);
+    }
+    if (!warm_)
+    {
+        fsiv_compute_camera_pose(_3dpoints, _2dpoints, camera_matrix,
+                                 dist_coeffs, rvec, tvec);
+        error = reprojection_error(_3dpoints, _2dpoints, camera_matrix,
+                                  dist_coeffs, rvec, tvec);
+    }
+    rvec_ = rvec.clone();
+    tvec_ = tvec.clone();
+    error_ = error;
+
+    CV_Assert(rvec.rows==3 && rvec.cols==1 && rvec.type()==CV_64FC1);
+    CV_Assert(tvec.rows==3 && tvec.cols==1 && tvec.type()==CV_64FC1);
+    return error;
+}
+
+bool
+PoseEstimator::warm() const
+{
+    return warm_;
+}
+
+void
+PoseEstimator::reset()
+{
+    rvec_.release();
+    tvec_.release();
+    warm_ = false;
+}
+
 void
 fsiv_draw_axes(cv::Mat& img,
                const cv::Mat& camera_matrix, const cv::Mat& dist_coeffs,
@@ -122,6 +492,56 @@ fsiv_load_calibration_parameters(cv::FileStorage &fs,
     return;
 }
 
+void
+fsiv_load_calibration_parameters(const std::string& fname,
+                                 cv::Size& camera_size,
+                                 float& error,
+                                 cv::Mat& camera_matrix,
+                                 cv::Mat& dist_coeffs,
+                                 cv::Mat& rvec,
+                                 cv::Mat& tvec)
+{
+    const MappedFile file(fname);
+    if (file.size() < sizeof(CALIB_MAGIC) ||
+        !std::equal(CALIB_MAGIC, CALIB_MAGIC + 8, reinterpret_cast<const char*>(file.data())))
+    {
+        cv::FileStorage fs(fname, cv::FileStorage::READ);
+        CV_Assert(fs.isOpened());
+        fsiv_load_calibration_parameters(fs, camera_size, error, camera_matrix,
+                                         dist_coeffs, rvec, tvec);
+        return;
+    }
+
+    // The values are copied from the mapping, nothing is parsed.
+    CalibFileHeader header;
+    CV_Assert(file.size() >= sizeof(header));
+    std::memcpy(&header, file.data(), sizeof(header));
+    CV_Assert(header.version == CALIB_VERSION && header.header_size == sizeof(header));
+    CV_Assert(file.size() == sizeof(header) + header.maps_size);
+    CV_Assert(header.checksum == calib_checksum(header, file.data() + sizeof(header),
+                                                header.maps_size));
+    CV_Assert(header.width > 0 && header.height > 0);
+    // The maps are saved only for cv::INTER_LINEAR (fixed point maps) and
+    // for the camera size.
+    CV_Assert(header.map_rows == 0 ||
+              (header.map_rows == header.height && header.map_cols == header.width
+               && header.map1_type == CV_16SC2 && header.map2_type == CV_16UC1
+               && header.map_interp == cv::INTER_LINEAR));
+    CV_Assert(header.map_rows > 0 || header.maps_size == 0);
+
+    camera_size = cv::Size(header.width, header.height);
+    error = static_cast<float>(header.error);
+    camera_matrix = cv::Mat(3, 3, CV_64FC1, header.camera_matrix).clone();
+    dist_coeffs = cv::Mat(1, 5, CV_64FC1, header.dist_coeffs).clone();
+    rvec = cv::Mat(3, 1, CV_64FC1, header.rvec).clone();
+    tvec = cv::Mat(3, 1, CV_64FC1, header.tvec).clone();
+
+    CV_Assert(camera_matrix.type()==CV_64FC1 && camera_matrix.rows==3 && camera_matrix.cols==3);
+    CV_Assert(dist_coeffs.type()==CV_64FC1 && dist_coeffs.rows==1 && dist_coeffs.cols==5);
+    CV_Assert(rvec.type()==CV_64FC1 && rvec.rows==3 && rvec.cols==1);
+    CV_Assert(tvec.type()==CV_64FC1 && tvec.rows==3 && tvec.cols==1);
+}
+
 void
 fsiv_draw_3d_model(cv::Mat &img, const cv::Mat& M, const cv::Mat& dist_coeffs,
                    const cv::Mat& rvec, const cv::Mat& tvec,
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string>
 #include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
@@ -29,6 +30,95 @@ bool fsiv_find_chessboard_corners(const cv::Mat& img, const cv::Size &board_size
                                   std::vector<cv::Point2f>& corner_points,
                                   const char * wname=nullptr);
 
+/**
+ * @brief Follow a calibration chessboard along the frames of a video.
+ * The corners of the last frame are tracked in the new frame with pyramidal
+ * Lucas-Kanade optical flow (the pyramid of each frame is built only once)
+ * and refined with cv::cornerSubPix(), so they do not drift. The track is
+ * accepted when all the corners were tracked and the RMS residual of the
+ * homography between the board and the tracked corners is small. Else,
+ * or when there is no track yet, the board is searched again.
+ * If the camera and the last poses are known (set_camera(), set_pose()),
+ * the search is first done in a padded crop around the board predicted
+ * with the last pose and its velocity (at reduced resolution when the crop
+ * is large), then in a wider crop, and at last in the whole frame with
+ * fsiv_find_chessboard_corners().
+ */
+class BoardTracker
+{
+public:
+    /**
+     * @brief Create a tracker.
+     * @param board_size is the inners board points geometry.
+     * @param max_residual is the max RMS homography residual (pixels) of
+     *  an accepted track.
+     * @pre board_size.width>1 && board_size.height>1
+     * @pre max_residual>0.0
+     */
+    explicit BoardTracker(const cv::Size& board_size, double max_residual=2.0);
+
+    /**
+     * @brief Find the board corners in the next frame.
+     * @param frame is the next frame.
+     * @param[out] corner_points are the corners, if the board was found.
+     * @return true if the board was found.
+     * @pre frame.type()==CV_8UC3
+     */
+    bool find(const cv::Mat& frame, std::vector<cv::Point2f>& corner_points);
+
+    /**
+     * @brief Set the camera and the board, used to predict where the board is.
+     * @param _3dpoints are the WCS 3D points of the board.
+     * @param camera_matrix is the camera matrix.
+     * @param dist_coeffs are the distortion coefficients.
+     * @pre _3dpoints.size()==board_size.area()
+     */
+    void set_camera(const std::vector<cv::Point3f>& _3dpoints,
+                    const cv::Mat& camera_matrix,
+                    const cv::Mat& dist_coeffs);
+
+    /**
+     * @brief Set the pose of the board found in the last frame.
+     * @param rvec is the rotation vector.
+     * @param tvec is the translation vector.
+     */
+    void set_pose(const cv::Mat& rvec, const cv::Mat& tvec);
+
+    /** @brief True if the last board found was tracked (not searched). */
+    bool tracked() const;
+
+    /** @brief Forget the track, so the next frame is searched. */
+    void reset();
+
+private:
+    /** @brief Result of the search around the predicted board. */
+    enum SearchResult
+    {
+        SEARCH_FOUND,
+        SEARCH_NOT_FOUND,
+        /** Not found, but the whole frame was searched at full resolution. */
+        SEARCH_FRAME_NOT_FOUND
+    };
+
+    bool track(std::vector<cv::Point2f>& corner_points);
+    SearchResult search_predicted(const cv::Mat& frame, std::vector<cv::Point2f>& corner_points);
+
+    cv::Size board_size_;
+    double max_residual_;
+    std::vector<cv::Point2f> board_points_;
+    std::vector<cv::Mat> prev_pyramid_;
+    std::vector<cv::Mat> pyramid_;
+    std::vector<cv::Point2f> prev_points_;
+    cv::Mat gray_;
+    bool tracked_;
+    std::vector<cv::Point3f> points3d_;
+    cv::Mat camera_matrix_;
+    cv::Mat dist_coeffs_;
+    cv::Mat rvec_, tvec_;
+    cv::Mat prev_rvec_, prev_tvec_;
+    int frames_since_pose_;
+};
+
 /**
  * @brief Project the 3D Camera Coordinate system on the image.
  * The X axis will be draw in red, the Y axis in green and the Z axis in blue.
@@ -75,6 +165,60 @@ void fsiv_compute_camera_pose(const std::vector<cv::Point3f>& _3dpoints,
                               cv::Mat& rvec,
                               cv::Mat& tvec);
 
+/**
+ * @brief Estimate the camera pose along the frames of a video.
+ * The pose of the last frame is a good initial guess for the next one, so
+ * it is refined with a capped number of Levenberg-Marquardt iterations
+ * (cv::solvePnPRefineLM()) instead of solving it from scratch. When there
+ * is no last pose, or the reprojection error of the refined pose jumps
+ * (more than max_error_jump times the last error), the pose is solved from
+ * scratch as fsiv_compute_camera_pose() does.
+ */
+class PoseEstimator
+{
+public:
+    /**
+     * @brief Create an estimator.
+     * @param max_iters is the max number of LM iterations of a warm solve.
+     * @param max_error_jump is the max ratio between the reprojection
+     *  error of a warm solve and the last error.
+     * @pre max_iters>0 && max_error_jump>=1.0
+     */
+    explicit PoseEstimator(int max_iters=10, double max_error_jump=2.0);
+
+    /**
+     * @brief Estimate the camera pose of the next frame.
+     * @param[in] _3dpoints are the WCS 3D points of the board.
+     * @param[in] _2dpoints are the refined corners detected.
+     * @param[in] camera_matrix is the camera matrix.
+     * @param[in] dist_coeffs are the distortion coefficients.
+     * @param[out] rvec is the computed rotation vector.
+     * @param[out] tvec is the computed translation vector.
+     * @return the RMS reprojection error of the pose.
+     * @pre _3dpoints.size()>=4 && _3dpoints.size()==_2dpoints.size()
+     * @post rvec and tvec are 3x1 CV_64FC1
+     */
+    float estimate(const std::vector<cv::Point3f>& _3dpoints,
+                   const std::vector<cv::Point2f>& _2dpoints,
+                   const cv::Mat& camera_matrix,
+                   const cv::Mat& dist_coeffs,
+                   cv::Mat& rvec,
+                   cv::Mat& tvec);
+
+    /** @brief True if the last pose was warm started. */
+    bool warm() const;
+
+    /** @brief Forget the last pose, so the next one is solved from scratch. */
+    void reset();
+
+private:
+    int max_iters_;
+    double max_error_jump_;
+    cv::Mat rvec_, tvec_;
+    float error_;
+    bool warm_;
+};
+
 /**
  * @brief Load the calibration parameters from a file.
  * The file will have the following labels:
@@ -105,6 +249,29 @@ void fsiv_load_calibration_parameters(cv::FileStorage &fs,
                                       cv::Mat& rvec,
                                       cv::Mat& tvec);
 
+/**
+ * @brief Load the calibration parameters from a file of any format.
+ * The format is detected by the file content. A binary file (".calib",
+ * written by the calibrate program) is memory mapped and its values
+ * copied, without parsing, once its version and checksum are checked. Its
+ * undistortion maps, if any, are not used here. Other files are read with
+ * cv::FileStorage, see fsiv_load_calibration_parameters(cv::FileStorage&, ...).
+ * @param[in] fname is the file name.
+ * @param[out] camera_size is the camera geometry in pixels.
+ * @param[out] error is the calibration error.
+ * @param[out] camera_matrix is the camera matrix.
+ * @param[out] dist_coeffs are the distortion coefficients.
+ * @param[out] rvec is the rotation vector.
+ * @param[out] tvec is the translation vector.
+ */
+void fsiv_load_calibration_parameters(const std::string& fname,
+                                      cv::Size &camera_size,
+                                      float& error,
+                                      cv::Mat& camera_matrix,
+                                      cv::Mat& dist_coeffs,
+                                      cv::Mat& rvec,
+                                      cv::Mat& tvec);
+
 /**
  * @brief Project input image on the output using the homography of the calibration board on the image plane.
  * @arg[in] input is the image to be projected.
@@ -28,6 +28,14 @@ const cv::String keys =
     "{s size         |<none>| square size.}"
     "{r rows         |<none>| number of board's rows.}"
     "{c cols         |<none>| number of board's cols.}"
+    "{m max_side     |1024  | largest image side used to find the board (0 means full resolution).}"
+    "{cache          |      | corner cache file (YAML/XML). Views already in it skip the board search. Not with --video.}"
+    "{incremental    |      | add the views one at a time, showing the error after each one.}"
+    "{n max_views    |0     | calibrate with at most n informative views (0 means all the views).}"
+    "{video          |      | the input is a video: use its sharp frames that differ from the last one used.}"
+    "{min_sharpness  |100   | min variance of the Laplacian of a video frame.}"
+    "{min_change     |8     | min mean absolute difference (gray levels) with the last video frame used.}"
+    "{maps           |      | with a binary output file (.calib), keep the undistortion maps too.}"
     "{@output        |<none>| filename for output intrinsics file.}"
     "{@input1        |<none>| first board's view.}"
     "{@input2        |      | second board's view.}"
@@ -51,8 +59,18 @@ main (int argc, char* const* argv)
         int rows = parser.get<int>("r");
         int cols = parser.get<int>("c");
         bool verbose = parser.has("verbose");
+        int max_side = parser.get<int>("m");
+        std::string cache_fname = parser.has("cache") ? parser.get<cv::String>("cache") : "";
+        bool incremental = parser.has("incremental");
+        int max_views = parser.get<int>("n");
+        bool from_video = parser.has("video");
+        double min_sharpness = parser.get<double>("min_sharpness");
+        double min_change = parser.get<double>("min_change");
+        bool with_maps = parser.has("maps");
         std::string output_fname = parser.get<cv::String>("@output");
-        if (!parser.check())
+        if (!parser.check() || max_views<0 || max_views==1 ||
+            min_sharpness<0.0 || min_change<0.0 ||
+            (from_video && !cache_fname.empty()))
         {
             parser.printErrors();
             return EXIT_FAILURE;
@@ -94,10 +112,8 @@ main (int argc, char* const* argv)
             img_input = cv::imread(input_fnames[0]);
 
             std::string intrinsic_fname = parser.get<cv::String> ("i");
-            cv::FileStorage fs_input (intrinsic_fname, cv::FileStorage::READ);
-            fsiv_load_calibration_parameters(fs_input, camera_size, error, 
+            fsiv_load_calibration_parameters(intrinsic_fname, camera_size, error,
                 camera_matrix, dist_coeffs, rvec, tvec);
-            fs_input.release();
             if(fsiv_find_chessboard_corners(img_input, board_size, points2d)){
                 fsiv_compute_camera_pose(points3d, points2d, camera_matrix, 
                     dist_coeffs, rvec, tvec);
@@ -106,10 +122,8 @@ main (int argc, char* const* argv)
                 exit(-1);
             }
 
-            cv::FileStorage fs_output (output_fname, cv::FileStorage::WRITE);
-            fsiv_save_calibration_parameters(fs_output, camera_size, error, 
-            camera_matrix, dist_coeffs, rvec, tvec);
-            fs_output.release();
+            fsiv_save_calibration_parameters(output_fname, camera_size, error,
+                camera_matrix, dist_coeffs, rvec, tvec, with_maps);
 
             //
             if (verbose)
@@ -131,40 +145,121 @@ main (int argc, char* const* argv)
             //Remember: For each view (at least two) you must find the
             //chessboard to get the 3D -> 2D matches.
 
-            if (input_fnames.size() < 2){
+            if (!from_video && input_fnames.size() < 2){
                 std::cout << "More than 2 input needed" << std::endl;
                 exit(-1);
             }
 
-            for (int i = 0; i < input_fnames.size(); i++){
-                img_input = cv::imread(input_fnames[i]);
-                if (fsiv_find_chessboard_corners(img_input, board_size, points2d)){
-                    camera_points.push_back(points2d);
-                    world_points.push_back(points3d);
+            // The views are processed in parallel. The views where the board
+            // is not found are reported and skipped.
+            std::vector<std::vector<cv::Point2f>> views_points;
+            std::vector<cv::Size> views_sizes;
+            std::vector<std::string> views_names;
+            if (from_video){
+                // Only the frames that pass a cheap screening are searched.
+                cv::VideoCapture input_video(input_fnames[0]);
+                if (!input_video.isOpened()){
+                    std::cerr << "Error: could not open the video '"
+                              << input_fnames[0] << "'." << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::vector<size_t> frames;
+                cv::Size frame_size;
+                const size_t n_frames = fsiv_find_video_chessboard_corners(
+                    input_video, board_size, views_points, frame_size, &frames,
+                    min_sharpness, min_change, max_side);
+                std::cout << "Frames read: " << n_frames << ", with the board: "
+                          << frames.size() << std::endl;
+                views_sizes.assign(views_points.size(), frame_size);
+                for (const size_t f : frames)
+                    views_names.push_back(input_fnames[0] + "#" + std::to_string(f));
+            } else {
+                fsiv_find_views_chessboard_corners(input_fnames, board_size,
+                    views_points, views_sizes, max_side, cache_fname);
+                views_names = input_fnames;
+            }
+
+            std::vector<size_t> used_views;
+            for (size_t i = 0; i < views_names.size(); i++){
+                if (views_sizes[i].area() == 0){
+                    std::cerr << "Warning: could not open view '"
+                              << views_names[i] << "'." << std::endl;
+                } else if (views_points[i].empty()){
+                    std::cerr << "Warning: chessboard not found in view '"
+                              << views_names[i] << "'." << std::endl;
+                } else if (!used_views.empty() && views_sizes[i] != camera_size){
+                    std::cerr << "Warning: view '" << views_names[i]
+                              << "' has a different size." << std::endl;
                 } else {
-                    std::cout << "Error finding chessboard corners" << std::endl;
-                    exit(-1);
+                    camera_size = views_sizes[i];
+                    camera_points.push_back(views_points[i]);
+                    world_points.push_back(points3d);
+                    used_views.push_back(i);
                 }
             }
+            if (used_views.size() < 2){
+                std::cerr << "Error: the chessboard was found in less than 2 views."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            // With many views, calibrate only with a subset of informative
+            // ones and measure the error against all the views.
+            std::vector<size_t> selected;
+            for (size_t i = 0; i < used_views.size(); i++)
+                selected.push_back(i);
+            if (max_views > 0 && used_views.size() > size_t(max_views))
+                selected = fsiv_select_calibration_views(camera_points,
+                    world_points, camera_size, max_views);
+            std::vector<std::vector<cv::Point2f>> selected_camera_points;
+            std::vector<std::vector<cv::Point3f>> selected_world_points;
+            for (const size_t i : selected){
+                selected_camera_points.push_back(camera_points[i]);
+                selected_world_points.push_back(world_points[i]);
+            }
 
             std::vector<cv::Mat> rvecs, tvecs;
-            camera_size = img_input.size();
-            error = fsiv_calibrate_camera(camera_points, world_points, camera_size,
-                camera_matrix, dist_coeffs, &rvecs, &tvecs);
+            if (incremental){
+                // Each re-solve is warm started from the last one.
+                IncrementalCalibrator calibrator(camera_size);
+                for (size_t i = 0; i < selected.size(); i++){
+                    const float e = calibrator.add_view(selected_camera_points[i],
+                                                        selected_world_points[i]);
+                    if (e >= 0.0f)
+                        std::cout << "Views: " << calibrator.views()
+                                  << " error: " << e << std::endl;
+                }
+                error = calibrator.error();
+                calibrator.camera_matrix().copyTo(camera_matrix);
+                calibrator.dist_coeffs().copyTo(dist_coeffs);
+                rvecs = calibrator.rvecs();
+                tvecs = calibrator.tvecs();
+            } else
+                error = fsiv_calibrate_camera(selected_camera_points,
+                    selected_world_points, camera_size,
+                    camera_matrix, dist_coeffs, &rvecs, &tvecs);
 
-            cv::FileStorage fs_output (output_fname, cv::FileStorage::WRITE);
-            fsiv_save_calibration_parameters(fs_output, camera_size, error, 
-                camera_matrix, dist_coeffs);
-            fs_output.release();
+            if (selected.size() < used_views.size()){
+                std::cout << "Selected " << selected.size() << " of "
+                          << used_views.size() << " views, error: " << error
+                          << std::endl;
+                error = fsiv_compute_reprojection_error(camera_points,
+                    world_points, camera_matrix, dist_coeffs, &rvecs, &tvecs);
+                std::cout << "Error against all the views: " << error << std::endl;
+            }
+
+            fsiv_save_calibration_parameters(output_fname, camera_size, error,
+                camera_matrix, dist_coeffs, cv::Mat::zeros(3, 1, CV_64FC1),
+                cv::Mat::zeros(3, 1, CV_64FC1), with_maps);
 
             //
 
-            if (verbose)
+            if (verbose && !from_video)
             {
                 //TODO
                 //Show WCS axis on each pattern view.
-                for (int i = 0; i < input_fnames.size(); i++){
-                    img_output = cv::imread(input_fnames[i]);
+                for (size_t i = 0; i < used_views.size(); i++){
+                    img_output = cv::imread(input_fnames[used_views[i]]);
                     fsiv_draw_axes(img_output, camera_matrix, dist_coeffs,
                         rvecs[i], tvecs[i], square_size, 3) ;
                     cv::imshow("OUTPUT", img_output);
@@ -1,8 +1,467 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/core/utility.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/calib3d.hpp>
 #include "common_code.hpp"
 
+namespace {
+
+// Parameters of the final corner refinement (cv::cornerSubPix).
+const int SUBPIX_WIN = 5;
+const int SUBPIX_ITERS = 40;
+const double SUBPIX_EPS = 0.001;
+
+// Parameters of the coarse corner refinement done when the board is found
+// in a scaled down image. Its window is ceil(1/scale) + COARSE_SUBPIX_MARGIN.
+const int COARSE_SUBPIX_MARGIN = 2;
+const int COARSE_SUBPIX_ITERS = 20;
+const double COARSE_SUBPIX_EPS = 0.01;
+
+// Stop criteria of the warm started re-solves of the incremental
+// calibration: they start near the solution, so they stop when the
+// parameters stop changing.
+const int WARM_CALIB_ITERS = 15;
+const double WARM_CALIB_EPS = 1e-7;
+
+// Grid (cells per side) used to score the coverage of the image plane and
+// angle (radians) from which two board poses are fully diverse when the
+// calibration views are selected.
+const int SELECT_GRID = 8;
+const double SELECT_ANGLE = CV_PI / 6.0;
+
+// Largest side of the gray copy used to screen the video frames and number
+// of screened frames searched in parallel for the board.
+const int SCREEN_SIDE = 320;
+const size_t DETECT_BATCH = 16;
+
+// Version of the corner cache file format.
+const int CORNER_CACHE_VERSION = 1;
+
+// FNV-1a 64 bits hash.
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t
+fnv1a(const void* data, size_t n, uint64_t h=FNV_OFFSET)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// Read a whole file. Return false if it can not be read.
+bool
+read_file(const std::string& fname, std::vector<uchar>& bytes)
+{
+    std::ifstream f(fname, std::ios::binary);
+    if (!f)
+        return false;
+    bytes.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    return !f.bad();
+}
+
+// The key of a view in the corner cache. It hashes the file content and
+// all the parameters that change the corners found.
+std::string
+corner_cache_key(const std::vector<uchar>& bytes, const cv::Size& board_size,
+                 int max_side)
+{
+    uint64_t h = fnv1a(bytes.data(), bytes.size());
+    const int params[] = {board_size.width, board_size.height, max_side,
+                          SUBPIX_WIN, SUBPIX_ITERS,
+                          COARSE_SUBPIX_MARGIN, COARSE_SUBPIX_ITERS};
+    h = fnv1a(params, sizeof(params), h);
+    h = fnv1a(&SUBPIX_EPS, sizeof(SUBPIX_EPS), h);
+    h = fnv1a(&COARSE_SUBPIX_EPS, sizeof(COARSE_SUBPIX_EPS), h);
+    char key[20];
+    std::snprintf(key, sizeof(key), "k%016llx", static_cast<unsigned long long>(h));
+    return key;
+}
+
+// A view in the corner cache. corners is empty if the board was not found.
+struct CachedView
+{
+    cv::Size size;
+    std::vector<cv::Point2f> corners;
+};
+
+typedef std::map<std::string, CachedView> CornerCache;
+
+// Load a corner cache file. The cache only saves work, so a missing,
+// truncated or malformed file, or one with other version, is an empty
+// cache, and the views whose corners are not a board_size board are
+// dropped.
+CornerCache
+load_corner_cache(const std::string& fname, const cv::Size& board_size)
+{
+    CornerCache cache;
+    if (!std::ifstream(fname))
+        return cache;
+    try {
+        cv::FileStorage fs(fname, cv::FileStorage::READ);
+        if (!fs.isOpened() || static_cast<int>(fs["corner-cache-version"]) != CORNER_CACHE_VERSION)
+            return cache;
+        const cv::FileNode views = fs["views"];
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            const cv::FileNode view = views[static_cast<int>(i)];
+            CachedView v;
+            v.size.width = static_cast<int>(view["width"]);
+            v.size.height = static_cast<int>(view["height"]);
+            view["corners"] >> v.corners;
+            if (v.size.width <= 0 || v.size.height <= 0 ||
+                (!v.corners.empty() && v.corners.size() != size_t(board_size.area())))
+                continue;
+            cache[static_cast<std::string>(view["key"])] = v;
+        }
+    }
+    catch (const cv::Exception&) {
+        return CornerCache();
+    }
+    return cache;
+}
+
+void
+save_corner_cache(const std::string& fname, const CornerCache& cache)
+{
+    cv::FileStorage fs(fname, cv::FileStorage::WRITE);
+    CV_Assert(fs.isOpened());
+    fs << "corner-cache-version" << CORNER_CACHE_VERSION;
+    fs << "views" << "[";
+    for (const auto& v : cache)
+    {
+        fs << "{" << "key" << v.first
+           << "width" << v.second.size.width
+           << "height" << v.second.size.height
+           << "corners" << v.second.corners << "}";
+    }
+    fs << "]";
+}
+
+// A bounded queue between two stages of a pipeline. When it is closed,
+// push() fails and pop() returns the items left and then fails.
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(capacity), closed_(false)
+    {}
+
+    bool
+    push(const T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]{ return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+        items_.push_back(item);
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool
+    pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]{ return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        item = items_.front();
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void
+    close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    const size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+// Remap an image with the undistortion maps into a new image. cv::remap()
+// already splits the rows among the threads of the OpenCV pool, so it is
+// called once for the whole image.
+cv::Mat
+remap_image(const cv::Mat& input, const UndistortMaps& maps, int interp)
+{
+    cv::Mat output;
+    cv::remap(input, output, maps.map1, maps.map2, interp, cv::BORDER_CONSTANT);
+    return output;
+}
+
+// An image of a batch and its index in the batch.
+struct ImageJob
+{
+    size_t index;
+    cv::Mat image;
+};
+
+// Images between two progress reports of a batch.
+const size_t PROGRESS_STEP = 50;
+
+// Magic of the undistortion map files (8 bytes, the last one is the version).
+const char MAPS_MAGIC[8] = {'F', 'S', 'I', 'V', 'M', 'A', 'P', '2'};
+
+// The key of the undistortion maps: a hash of the intrinsics, the image
+// size and the interpolation.
+uint64_t
+undistort_maps_key(const cv::Mat& camera_matrix, const cv::Mat& dist_coeffs,
+                   const cv::Size& size, int interp)
+{
+    cv::Mat K, D;
+    camera_matrix.convertTo(K, CV_64F);
+    dist_coeffs.convertTo(D, CV_64F);
+    K = K.clone();
+    D = D.clone();
+    uint64_t h = fnv1a(K.ptr(), K.total()*K.elemSize());
+    h = fnv1a(D.ptr(), D.total()*D.elemSize(), h);
+    const int params[] = {size.width, size.height, interp};
+    return fnv1a(params, sizeof(params), h);
+}
+
+std::string
+undistort_maps_fname(const std::string& dir, uint64_t key)
+{
+    char name[40];
+    std::snprintf(name, sizeof(name), "undistort-%016llx.map",
+                  static_cast<unsigned long long>(key));
+    return dir + "/" + name;
+}
+
+// A map file is the magic, the key, the size and the types of the maps,
+// the checksum (the hash of the size, the types and the maps) and then the
+// raw rows of map1 and map2. The maps are loaded only if the size and the
+// types are the expected ones, the checksum matches and there is nothing
+// after the maps.
+bool
+load_undistort_maps(const std::string& fname, uint64_t key, const cv::Size& size,
+                    UndistortMaps& maps)
+{
+    std::ifstream f(fname, std::ios::binary);
+    char magic[8];
+    uint64_t file_key, checksum;
+    int32_t header[4];
+    if (!f.read(magic, sizeof(magic)) || !std::equal(magic, magic + 8, MAPS_MAGIC)
+        || !f.read(reinterpret_cast<char*>(&file_key), sizeof(file_key)) || file_key != key
+        || !f.read(reinterpret_cast<char*>(header), sizeof(header))
+        || header[0] != size.height || header[1] != size.width
+        || header[2] != CV_16SC2 || header[3] != CV_16UC1
+        || !f.read(reinterpret_cast<char*>(&checksum), sizeof(checksum)))
+        return false;
+    maps.map1.create(header[0], header[1], header[2]);
+    maps.map2.create(header[0], header[1], header[3]);
+    uint64_t h = fnv1a(header, sizeof(header));
+    for (cv::Mat* m : {&maps.map1, &maps.map2})
+        for (int y = 0; y < m->rows; ++y)
+        {
+            if (!f.read(reinterpret_cast<char*>(m->ptr(y)), m->cols*m->elemSize()))
+                return false;
+            h = fnv1a(m->ptr(y), m->cols*m->elemSize(), h);
+        }
+    return h == checksum && f.peek() == std::ifstream::traits_type::eof();
+}
+
+// Create an empty temporary file next to fname, with a name unique among
+// all the threads and processes (mkstemp). Return its name, or an empty
+// string if it can not be created.
+std::string
+make_tmp_file(const std::string& fname)
+{
+    std::vector<char> name(fname.begin(), fname.end());
+    const char suffix[] = ".tmpXXXXXX";
+    name.insert(name.end(), suffix, suffix + sizeof(suffix));
+    const int fd = ::mkstemp(name.data());
+    if (fd < 0)
+        return "";
+    // mkstemp() creates it only readable by the owner.
+    ::fchmod(fd, 0644);
+    ::close(fd);
+    return name.data();
+}
+
+// The file is written with other name and then renamed, so other
+// processes never see it half written.
+void
+save_undistort_maps(const std::string& fname, uint64_t key, const UndistortMaps& maps)
+{
+    const std::string tmp_fname = make_tmp_file(fname);
+    if (tmp_fname.empty())
+        return;
+    {
+        std::ofstream f(tmp_fname, std::ios::binary);
+        const int32_t header[4] = {maps.map1.rows, maps.map1.cols,
+                                   maps.map1.type(), maps.map2.type()};
+        f.write(MAPS_MAGIC, sizeof(MAPS_MAGIC));
+        f.write(reinterpret_cast<const char*>(&key), sizeof(key));
+        uint64_t checksum = fnv1a(header, sizeof(header));
+        for (const cv::Mat* m : {&maps.map1, &maps.map2})
+            for (int y = 0; y < m->rows; ++y)
+                checksum = fnv1a(m->ptr(y), m->cols*m->elemSize(), checksum);
+        f.write(reinterpret_cast<const char*>(header), sizeof(header));
+        f.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+        for (const cv::Mat* m : {&maps.map1, &maps.map2})
+            for (int y = 0; y < m->rows; ++y)
+                f.write(reinterpret_cast<const char*>(m->ptr(y)), m->cols*m->elemSize());
+        if (!f)
+        {
+            f.close();
+            std::remove(tmp_fname.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp_fname.c_str(), fname.c_str()) != 0)
+        std::remove(tmp_fname.c_str());
+}
+
+// The in-process map cache (see fsiv_get_undistort_maps()).
+std::mutex maps_cache_mutex;
+std::map<uint64_t, std::shared_ptr<const UndistortMaps>> maps_cache;
+
+std::shared_ptr<const UndistortMaps>
+insert_undistort_maps(uint64_t key, const std::shared_ptr<const UndistortMaps>& maps)
+{
+    std::lock_guard<std::mutex> lock(maps_cache_mutex);
+    return maps_cache.insert(std::make_pair(key, maps)).first->second;
+}
+
+// The binary calibration file is this header and then, if map_rows>0,
+// the raw rows of map1 and map2. All the values are in the host byte
+// order. The checksum is the hash of the header, with the checksum set to
+// 0, and of the maps.
+const char CALIB_MAGIC[8] = {'F', 'S', 'I', 'V', 'C', 'A', 'L', 'B'};
+const uint32_t CALIB_VERSION = 1;
+const char CALIB_EXTENSION[] = ".calib";
+
+struct CalibFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t width, height;
+    double error;
+    double camera_matrix[9];
+    double dist_coeffs[5];
+    double rvec[3];
+    double tvec[3];
+    int32_t map_rows, map_cols;
+    int32_t map1_type, map2_type;
+    int32_t map_interp, reserved;
+    uint64_t maps_size;
+    uint64_t checksum;
+};
+
+bool
+is_binary_calibration_fname(const std::string& fname)
+{
+    const size_t n = sizeof(CALIB_EXTENSION) - 1;
+    return fname.size() > n && fname.compare(fname.size() - n, n, CALIB_EXTENSION) == 0;
+}
+
+uint64_t
+calib_checksum(CalibFileHeader header, const uchar* maps, size_t maps_size)
+{
+    header.checksum = 0;
+    return fnv1a(maps, maps_size, fnv1a(&header, sizeof(header)));
+}
+
+// A read only memory mapping of a whole file. It is empty if the file
+// could not be mapped.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& fname)
+        : data_(nullptr), size_(0)
+    {
+        const int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data_ = static_cast<const uchar*>(p);
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile()
+    {
+        if (data_ != nullptr)
+            ::munmap(const_cast<uchar*>(data_), size_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uchar* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uchar* data_;
+    size_t size_;
+};
+
+void
+save_binary_calibration(const std::string& fname, const CalibFileHeader& header,
+                        const UndistortMaps* maps)
+{
+    const std::string tmp_fname = make_tmp_file(fname);
+    CV_Assert(!tmp_fname.empty());
+    bool written;
+    {
+        std::ofstream f(tmp_fname, std::ios::binary);
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (maps != nullptr)
+            for (const cv::Mat* m : {&maps->map1, &maps->map2})
+                for (int y = 0; y < m->rows; ++y)
+                    f.write(reinterpret_cast<const char*>(m->ptr(y)), m->cols*m->elemSize());
+        written = f.good();
+    }
+    written = written && std::rename(tmp_fname.c_str(), fname.c_str()) == 0;
+    if (!written)
+        std::remove(tmp_fname.c_str());
+    CV_Assert(written);
+}
+
+} // namespace
+
 std::vector<cv::Point3f>
 fsiv_generate_3d_calibration_points(const cv::Size& board_size,
                                     float square_size)
@@ -52,6 +511,220 @@ fsiv_find_chessboard_corners(const cv::Mat& img, const cv::Size &board_size,
     return was_found;
 }
 
+bool
+fsiv_find_chessboard_corners_scaled(const cv::Mat& img,
+                                    const cv::Size &board_size,
+                                    std::vector<cv::Point2f>& corner_points,
+                                    int max_side)
+{
+    CV_Assert(img.type()==CV_8UC3);
+    CV_Assert(max_side>=0);
+
+    cv::Mat gray;
+    cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    const int side = std::max(img.cols, img.rows);
+    const double scale = (max_side > 0 && side > max_side)
+            ? static_cast<double>(max_side)/side : 1.0;
+
+    bool was_found = false;
+    if (scale < 1.0)
+    {
+        cv::Mat small;
+        cv::resize(gray, small, cv::Size(), scale, scale, cv::INTER_AREA);
+        was_found = cv::findChessboardCorners(small, board_size, corner_points);
+        if (was_found)
+        {
+            // The corners are only accurate to about one pixel of the small
+            // image, so a first refinement with a window that wide is done.
+            for (auto& p : corner_points)
+                p *= 1.0/scale;
+            const int win = cvCeil(1.0/scale) + COARSE_SUBPIX_MARGIN;
+            cv::cornerSubPix(gray, corner_points, cv::Size(win, win), cv::Size(-1, -1),
+                             cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
+                                              COARSE_SUBPIX_ITERS, COARSE_SUBPIX_EPS));
+        }
+    }
+    else
+        was_found = cv::findChessboardCorners(gray, board_size, corner_points);
+
+    if (was_found)
+    {
+        cv::TermCriteria criteria = cv::TermCriteria(
+            cv::TermCriteria::EPS + cv::TermCriteria::COUNT,
+            SUBPIX_ITERS,
+            SUBPIX_EPS
+        );
+        cv::cornerSubPix(gray, corner_points, cv::Size(SUBPIX_WIN, SUBPIX_WIN),
+                         cv::Size(-1, -1), criteria);
+    }
+    return was_found;
+}
+
+int
+fsiv_find_views_chessboard_corners(const std::vector<std::string>& fnames,
+                                   const cv::Size &board_size,
+                                   std::vector<std::vector<cv::Point2f>>& corner_points,
+                                   std::vector<cv::Size>& view_sizes,
+                                   int max_side,
+                                   const std::string& cache_fname)
+{
+    CV_Assert(max_side>=0);
+    corner_points.assign(fnames.size(), std::vector<cv::Point2f>());
+    view_sizes.assign(fnames.size(), cv::Size());
+
+    const bool use_cache = !cache_fname.empty();
+    const CornerCache cache = use_cache ? load_corner_cache(cache_fname, board_size)
+                                        : CornerCache();
+    std::vector<std::string> new_keys(fnames.size());
+
+    // One view per task. Each task writes only its own slots, so the
+    // results keep the input order. With a cache, the key is the hash of
+    // the file, so the cached views are not even decoded.
+    cv::parallel_for_(cv::Range(0, static_cast<int>(fnames.size())),
+                      [&](const cv::Range& range)
+    {
+        std::vector<uchar> bytes;
+        for (int i = range.start; i < range.end; ++i)
+        {
+            cv::Mat img;
+            std::string key;
+            if (use_cache)
+            {
+                if (!read_file(fnames[i], bytes))
+                    continue;
+                key = corner_cache_key(bytes, board_size, max_side);
+                const auto cached = cache.find(key);
+                if (cached != cache.end())
+                {
+                    view_sizes[i] = cached->second.size;
+                    corner_points[i] = cached->second.corners;
+                    continue;
+                }
+                img = cv::imdecode(bytes, cv::IMREAD_COLOR);
+            }
+            else
+                img = cv::imread(fnames[i]);
+            if (img.empty())
+                continue;
+            view_sizes[i] = img.size();
+            if (!fsiv_find_chessboard_corners_scaled(img, board_size,
+                                                     corner_points[i], max_side))
+                corner_points[i].clear();
+            new_keys[i] = key;
+        }
+    }, static_cast<double>(fnames.size()));
+
+    if (use_cache)
+    {
+        CornerCache updated(cache);
+        for (size_t i = 0; i < fnames.size(); ++i)
+            if (!new_keys[i].empty())
+            {
+                updated[new_keys[i]].size = view_sizes[i];
+                updated[new_keys[i]].corners = corner_points[i];
+            }
+        if (updated.size() != cache.size())
+            save_corner_cache(cache_fname, updated);
+    }
+
+    int found = 0;
+    for (const auto& points : corner_points)
+        if (!points.empty())
+            ++found;
+
+    CV_Assert(corner_points.size()==fnames.size());
+    CV_Assert(view_sizes.size()==fnames.size());
+    return found;
+}
+
+size_t
+fsiv_find_video_chessboard_corners(cv::VideoCapture& input,
+                                   const cv::Size &board_size,
+                                   std::vector<std::vector<cv::Point2f>>& corner_points,
+                                   cv::Size& frame_size,
+                                   std::vector<size_t>* frame_indices,
+                                   double min_sharpness,
+                                   double min_change,
+                                   int max_side)
+{
+    CV_Assert(input.isOpened());
+    CV_Assert(min_sharpness>=0.0 && min_change>=0.0 && max_side>=0);
+    corner_points.clear();
+    if (frame_indices != nullptr)
+        frame_indices->clear();
+
+    std::vector<cv::Mat> batch;
+    std::vector<size_t> batch_indices;
+    std::vector<std::vector<cv::Point2f>> batch_points;
+    auto detect_batch = [&]()
+    {
+        batch_points.assign(batch.size(), std::vector<cv::Point2f>());
+        cv::parallel_for_(cv::Range(0, static_cast<int>(batch.size())),
+                          [&](const cv::Range& range)
+        {
+            for (int i = range.start; i < range.end; ++i)
+                if (!fsiv_find_chessboard_corners_scaled(batch[i], board_size,
+                                                         batch_points[i], max_side))
+                    batch_points[i].clear();
+        }, static_cast<double>(batch.size()));
+        for (size_t i = 0; i < batch.size(); ++i)
+            if (!batch_points[i].empty())
+            {
+                corner_points.push_back(batch_points[i]);
+                if (frame_indices != nullptr)
+                    frame_indices->push_back(batch_indices[i]);
+            }
+        batch.clear();
+        batch_indices.clear();
+    };
+
+    cv::Mat frame, gray, small, last_small, laplacian;
+    size_t n_frames = 0;
+    while (input.read(frame) && !frame.empty())
+    {
+        const size_t index = n_frames++;
+        frame_size = frame.size();
+
+        if (frame.channels() == 3)
+            cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+        else
+            gray = frame;
+        const double scale = std::min(1.0, double(SCREEN_SIDE) /
+                                      std::max(gray.cols, gray.rows));
+        if (scale < 1.0)
+            cv::resize(gray, small, cv::Size(), scale, scale, cv::INTER_AREA);
+        else
+            gray.copyTo(small);
+
+        cv::Laplacian(small, laplacian, CV_32F);
+        cv::Scalar mean, stddev;
+        cv::meanStdDev(laplacian, mean, stddev);
+        if (stddev[0]*stddev[0] < min_sharpness)
+            continue;
+        if (!last_small.empty() &&
+            cv::norm(small, last_small, cv::NORM_L1) < min_change*small.total())
+            continue;
+
+        small.copyTo(last_small);
+        // The board search needs a colour image.
+        if (frame.channels() == 3)
+            batch.push_back(frame.clone());
+        else
+        {
+            batch.push_back(cv::Mat());
+            cv::cvtColor(frame, batch.back(), cv::COLOR_GRAY2BGR);
+        }
+        batch_indices.push_back(index);
+        if (batch.size() == DETECT_BATCH)
+            detect_batch();
+    }
+    if (!batch.empty())
+        detect_batch();
+
+    CV_Assert(frame_indices==nullptr || frame_indices->size()==corner_points.size());
+    return n_frames;
+}
+
 float
 fsiv_calibrate_camera(const std::vector<std::vector<cv::Point2f>>& _2d_points,
                       const std::vector<std::vector<cv::Point3f>>& _3d_points,
@@ -84,6 +757,194 @@ fsiv_calibrate_camera(const std::vector<std::vector<cv::Point2f>>& _2d_points,
     return error;
 }
 
+std::vector<size_t>
+fsiv_select_calibration_views(const std::vector<std::vector<cv::Point2f>>& _2d_points,
+                              const std::vector<std::vector<cv::Point3f>>& _3d_points,
+                              const cv::Size& camera_size,
+                              size_t max_views)
+{
+    CV_Assert(_3d_points.size()==_2d_points.size());
+    CV_Assert(max_views>=2);
+    CV_Assert(camera_size.width>0 && camera_size.height>0);
+    const size_t n_views = _2d_points.size();
+
+    // Cells covered by each view.
+    std::vector<std::vector<int>> cells(n_views);
+    for (size_t v = 0; v < n_views; ++v)
+    {
+        std::vector<bool> mark(SELECT_GRID*SELECT_GRID, false);
+        for (const cv::Point2f& p : _2d_points[v])
+        {
+            const int cx = std::min(std::max(int(p.x*SELECT_GRID/camera_size.width), 0),
+                                    SELECT_GRID-1);
+            const int cy = std::min(std::max(int(p.y*SELECT_GRID/camera_size.height), 0),
+                                    SELECT_GRID-1);
+            mark[cy*SELECT_GRID+cx] = true;
+        }
+        for (int c = 0; c < SELECT_GRID*SELECT_GRID; ++c)
+            if (mark[c])
+                cells[v].push_back(c);
+    }
+
+    // Board normal of each view, with a nominal camera (focal length equal
+    // to the largest side, centered principal point, no distortion).
+    const double f = std::max(camera_size.width, camera_size.height);
+    cv::Mat nominal = cv::Mat::eye(3, 3, CV_64FC1);
+    nominal.at<double>(0, 0) = nominal.at<double>(1, 1) = f;
+    nominal.at<double>(0, 2) = camera_size.width/2.0;
+    nominal.at<double>(1, 2) = camera_size.height/2.0;
+    std::vector<cv::Vec3d> normals(n_views);
+    for (size_t v = 0; v < n_views; ++v)
+    {
+        cv::Mat rvec, tvec, R;
+        cv::solvePnP(_3d_points[v], _2d_points[v], nominal, cv::Mat(), rvec, tvec);
+        cv::Rodrigues(rvec, R);
+        normals[v] = cv::Vec3d(R.at<double>(0, 2), R.at<double>(1, 2), R.at<double>(2, 2));
+    }
+
+    std::vector<size_t> selected;
+    std::vector<bool> used(n_views, false);
+    std::vector<bool> covered(SELECT_GRID*SELECT_GRID, false);
+    const double n_cells = SELECT_GRID*SELECT_GRID;
+    while (selected.size() < std::min(max_views, n_views))
+    {
+        size_t best = n_views;
+        double best_score = -1.0;
+        for (size_t v = 0; v < n_views; ++v)
+        {
+            if (used[v])
+                continue;
+            int new_cells = 0;
+            for (const int c : cells[v])
+                new_cells += !covered[c];
+            double min_angle = SELECT_ANGLE;
+            for (const size_t s : selected)
+            {
+                const double cosine = std::min(std::abs(normals[v].dot(normals[s])), 1.0);
+                min_angle = std::min(min_angle, std::acos(cosine));
+            }
+            const double score = new_cells/n_cells + min_angle/SELECT_ANGLE;
+            if (score > best_score)
+            {
+                best_score = score;
+                best = v;
+            }
+        }
+        used[best] = true;
+        selected.push_back(best);
+        for (const int c : cells[best])
+            covered[c] = true;
+    }
+    std::sort(selected.begin(), selected.end());
+
+    CV_Assert(selected.size()==std::min(max_views, n_views));
+    return selected;
+}
+
+float
+fsiv_compute_reprojection_error(const std::vector<std::vector<cv::Point2f>>& _2d_points,
+                                const std::vector<std::vector<cv::Point3f>>& _3d_points,
+                                const cv::Mat& camera_matrix,
+                                const cv::Mat& dist_coeffs,
+                                std::vector<cv::Mat>* rvecs,
+                                std::vector<cv::Mat>* tvecs)
+{
+    CV_Assert(!_2d_points.empty() && _3d_points.size()==_2d_points.size());
+    if (rvecs != nullptr)
+        rvecs->resize(_2d_points.size());
+    if (tvecs != nullptr)
+        tvecs->resize(_2d_points.size());
+
+    double sq_error = 0.0;
+    size_t n_points = 0;
+    std::vector<cv::Point2f> projected;
+    for (size_t v = 0; v < _2d_points.size(); ++v)
+    {
+        cv::Mat rvec, tvec;
+        cv::solvePnP(_3d_points[v], _2d_points[v], camera_matrix, dist_coeffs, rvec, tvec);
+        cv::projectPoints(_3d_points[v], rvec, tvec, camera_matrix, dist_coeffs, projected);
+        for (size_t i = 0; i < projected.size(); ++i)
+        {
+            const cv::Point2f d = projected[i] - _2d_points[v][i];
+            sq_error += d.dot(d);
+        }
+        n_points += projected.size();
+        if (rvecs != nullptr)
+            (*rvecs)[v] = rvec;
+        if (tvecs != nullptr)
+            (*tvecs)[v] = tvec;
+    }
+    return float(std::sqrt(sq_error / n_points));
+}
+
+IncrementalCalibrator::IncrementalCalibrator(const cv::Size& camera_size)
+    : camera_size_(camera_size), error_(-1.0f)
+{
+    CV_Assert(camera_size.width>0 && camera_size.height>0);
+}
+
+float
+IncrementalCalibrator::add_view(const std::vector<cv::Point2f>& _2d_points,
+                                const std::vector<cv::Point3f>& _3d_points)
+{
+    CV_Assert(_3d_points.size()>=4 && _3d_points.size()==_2d_points.size());
+    _2d_points_.push_back(_2d_points);
+    _3d_points_.push_back(_3d_points);
+    if (_2d_points_.size() < 2)
+        return error_;
+
+    if (camera_matrix_.empty())
+        error_ = cv::calibrateCamera(_3d_points_, _2d_points_, camera_size_,
+                                     camera_matrix_, dist_coeffs_, rvecs_, tvecs_);
+    else
+        error_ = cv::calibrateCamera(_3d_points_, _2d_points_, camera_size_,
+                                     camera_matrix_, dist_coeffs_, rvecs_, tvecs_,
+                                     cv::CALIB_USE_INTRINSIC_GUESS,
+                                     cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                                                      WARM_CALIB_ITERS, WARM_CALIB_EPS));
+
+    CV_Assert(camera_matrix_.rows==3 && camera_matrix_.cols==3 &&
+              camera_matrix_.type()==CV_64FC1);
+    CV_Assert(rvecs_.size()==_2d_points_.size() && tvecs_.size()==_2d_points_.size());
+    return error_;
+}
+
+size_t
+IncrementalCalibrator::views() const
+{
+    return _2d_points_.size();
+}
+
+float
+IncrementalCalibrator::error() const
+{
+    return error_;
+}
+
+const cv::Mat&
+IncrementalCalibrator::camera_matrix() const
+{
+    return camera_matrix_;
+}
+
+const cv::Mat&
+IncrementalCalibrator::dist_coeffs() const
+{
+    return dist_coeffs_;
+}
+
+const std::vector<cv::Mat>&
+IncrementalCalibrator::rvecs() const
+{
+    return rvecs_;
+}
+
+const std::vector<cv::Mat>&
+IncrementalCalibrator::tvecs() const
+{
+    return tvecs_;
+}
+
 void fsiv_compute_camera_pose(const std::vector<cv::Point3f> &_3dpoints,
                               const std::vector<cv::Point2f> &_2dpoints,
                               const cv::Mat& camera_matrix,
@@ -182,15 +1043,186 @@ fsiv_load_calibration_parameters(cv::FileStorage &fs,
     return;
 }
 
+void
+fsiv_save_calibration_parameters(const std::string& fname,
+                                 const cv::Size& camera_size,
+                                 float error,
+                                 const cv::Mat& camera_matrix,
+                                 const cv::Mat& dist_coeffs,
+                                 const cv::Mat& rvec,
+                                 const cv::Mat& tvec,
+                                 bool with_maps)
+{
+    CV_Assert(camera_matrix.type()==CV_64FC1 && camera_matrix.rows==3 && camera_matrix.cols==3);
+    CV_Assert(dist_coeffs.type()==CV_64FC1 && dist_coeffs.rows==1 && dist_coeffs.cols==5);
+    CV_Assert(rvec.type()==CV_64FC1 && rvec.rows==3 && rvec.cols==1);
+    CV_Assert(tvec.type()==CV_64FC1 && tvec.rows==3 && tvec.cols==1);
+
+    if (!is_binary_calibration_fname(fname))
+    {
+        cv::FileStorage fs(fname, cv::FileStorage::WRITE);
+        fsiv_save_calibration_parameters(fs, camera_size, error, camera_matrix,
+                                         dist_coeffs, rvec, tvec);
+        return;
+    }
+
+    CalibFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::copy(CALIB_MAGIC, CALIB_MAGIC + 8, header.magic);
+    header.version = CALIB_VERSION;
+    header.header_size = sizeof(header);
+    header.width = camera_size.width;
+    header.height = camera_size.height;
+    header.error = error;
+    for (int i = 0; i < 9; ++i)
+        header.camera_matrix[i] = camera_matrix.at<double>(i/3, i%3);
+    for (int i = 0; i < 5; ++i)
+        header.dist_coeffs[i] = dist_coeffs.at<double>(0, i);
+    for (int i = 0; i < 3; ++i)
+    {
+        header.rvec[i] = rvec.at<double>(i, 0);
+        header.tvec[i] = tvec.at<double>(i, 0);
+    }
+
+    std::shared_ptr<const UndistortMaps> maps;
+    std::vector<uchar> maps_bytes;
+    if (with_maps)
+    {
+        maps = fsiv_get_undistort_maps(camera_matrix, dist_coeffs, camera_size);
+        header.map_rows = maps->map1.rows;
+        header.map_cols = maps->map1.cols;
+        header.map1_type = maps->map1.type();
+        header.map2_type = maps->map2.type();
+        header.map_interp = cv::INTER_LINEAR;
+        for (const cv::Mat* m : {&maps->map1, &maps->map2})
+            for (int y = 0; y < m->rows; ++y)
+                maps_bytes.insert(maps_bytes.end(), m->ptr(y),
+                                  m->ptr(y) + m->cols*m->elemSize());
+        header.maps_size = maps_bytes.size();
+    }
+    header.checksum = calib_checksum(header, maps_bytes.data(), maps_bytes.size());
+    save_binary_calibration(fname, header, maps.get());
+}
+
+void
+fsiv_load_calibration_parameters(const std::string& fname,
+                                 cv::Size& camera_size,
+                                 float& error,
+                                 cv::Mat& camera_matrix,
+                                 cv::Mat& dist_coeffs,
+                                 cv::Mat& rvec,
+                                 cv::Mat& tvec)
+{
+    const MappedFile file(fname);
+    if (file.size() < sizeof(CALIB_MAGIC) ||
+        !std::equal(CALIB_MAGIC, CALIB_MAGIC + 8, reinterpret_cast<const char*>(file.data())))
+    {
+        cv::FileStorage fs(fname, cv::FileStorage::READ);
+        CV_Assert(fs.isOpened());
+        fsiv_load_calibration_parameters(fs, camera_size, error, camera_matrix,
+                                         dist_coeffs, rvec, tvec);
+        return;
+    }
+
+    // The values are copied from the mapping, nothing is parsed.
+    CalibFileHeader header;
+    CV_Assert(file.size() >= sizeof(header));
+    std::memcpy(&header, file.data(), sizeof(header));
+    CV_Assert(header.version == CALIB_VERSION && header.header_size == sizeof(header));
+    CV_Assert(file.size() == sizeof(header) + header.maps_size);
+    const uchar* maps_data = file.data() + sizeof(header);
+    CV_Assert(header.checksum == calib_checksum(header, maps_data, header.maps_size));
+    CV_Assert(header.width > 0 && header.height > 0);
+    // The maps are saved only for cv::INTER_LINEAR (fixed point maps) and
+    // for the camera size.
+    CV_Assert(header.map_rows == 0 ||
+              (header.map_rows == header.height && header.map_cols == header.width
+               && header.map1_type == CV_16SC2 && header.map2_type == CV_16UC1
+               && header.map_interp == cv::INTER_LINEAR));
+    CV_Assert(header.map_rows > 0 || header.maps_size == 0);
+
+    camera_size = cv::Size(header.width, header.height);
+    error = static_cast<float>(header.error);
+    camera_matrix = cv::Mat(3, 3, CV_64FC1, header.camera_matrix).clone();
+    dist_coeffs = cv::Mat(1, 5, CV_64FC1, header.dist_coeffs).clone();
+    rvec = cv::Mat(3, 1, CV_64FC1, header.rvec).clone();
+    tvec = cv::Mat(3, 1, CV_64FC1, header.tvec).clone();
+
+    // The maps go to the map cache, so fsiv_get_undistort_maps() does not
+    // build them.
+    if (header.map_rows > 0)
+    {
+        std::shared_ptr<UndistortMaps> maps = std::make_shared<UndistortMaps>();
+        maps->map1.create(header.map_rows, header.map_cols, header.map1_type);
+        maps->map2.create(header.map_rows, header.map_cols, header.map2_type);
+        CV_Assert(header.maps_size == maps->map1.total()*maps->map1.elemSize()
+                  + maps->map2.total()*maps->map2.elemSize());
+        for (cv::Mat* m : {&maps->map1, &maps->map2})
+            for (int y = 0; y < m->rows; ++y)
+            {
+                const size_t row_size = m->cols*m->elemSize();
+                std::memcpy(m->ptr(y), maps_data, row_size);
+                maps_data += row_size;
+            }
+        insert_undistort_maps(undistort_maps_key(camera_matrix, dist_coeffs,
+                                                 cv::Size(header.map_cols, header.map_rows),
+                                                 header.map_interp),
+                              maps);
+    }
+
+    CV_Assert(camera_matrix.type()==CV_64FC1 && camera_matrix.rows==3 && camera_matrix.cols==3);
+    CV_Assert(dist_coeffs.type()==CV_64FC1 && dist_coeffs.rows==1 && dist_coeffs.cols==5);
+    CV_Assert(rvec.type()==CV_64FC1 && rvec.rows==3 && rvec.cols==1);
+    CV_Assert(tvec.type()==CV_64FC1 && tvec.rows==3 && tvec.cols==1);
+}
+
+std::shared_ptr<const UndistortMaps>
+fsiv_get_undistort_maps(const cv::Mat& camera_matrix,
+                        const cv::Mat& dist_coeffs,
+                        const cv::Size& size,
+                        int interp,
+                        const std::string& cache_dir)
+{
+    CV_Assert(size.width>0 && size.height>0);
+    const uint64_t key = undistort_maps_key(camera_matrix, dist_coeffs, size, interp);
+    {
+        std::lock_guard<std::mutex> lock(maps_cache_mutex);
+        const auto found = maps_cache.find(key);
+        if (found != maps_cache.end())
+            return found->second;
+    }
+
+    // The maps are built without the lock. If two threads build the same
+    // maps, the first one inserted is kept.
+    std::shared_ptr<UndistortMaps> maps = std::make_shared<UndistortMaps>();
+    const std::string fname = cache_dir.empty() ? "" : undistort_maps_fname(cache_dir, key);
+    if (fname.empty() || !load_undistort_maps(fname, key, size, *maps))
+    {
+        cv::initUndistortRectifyMap(camera_matrix, dist_coeffs, cv::Mat(),
+                                    camera_matrix, size, CV_16SC2,
+                                    maps->map1, maps->map2);
+        if (!fname.empty())
+            save_undistort_maps(fname, key, *maps);
+    }
+
+    return insert_undistort_maps(key, maps);
+}
+
 void
 fsiv_undistort_image(const cv::Mat& input, cv::Mat& output,
                      const cv::Mat& camera_matrix,
-                     const cv::Mat& dist_coeffs)
+                     const cv::Mat& dist_coeffs,
+                     const std::string& map_cache_dir)
 {
     //TODO
     //Hint: use cv::undistort.
-    output = input.clone();
-    cv::undistort(input, output, camera_matrix, dist_coeffs);
+
+    // The same as cv::undistort(), but the maps are built only once for
+    // each camera and image size.
+    const std::shared_ptr<const UndistortMaps> maps = fsiv_get_undistort_maps(
+            camera_matrix, dist_coeffs, input.size(), cv::INTER_LINEAR, map_cache_dir);
+    cv::remap(input, output, maps->map1, maps->map2, cv::INTER_LINEAR,
+              cv::BORDER_CONSTANT);
     //
 }
 
@@ -236,3 +1268,199 @@ fsiv_undistort_video_stream(cv::VideoCapture&input_stream,
     CV_Assert(input_stream.isOpened());
     CV_Assert(output_stream.isOpened());
 }
+
+size_t
+fsiv_undistort_video_stream_headless(cv::VideoCapture& input_stream,
+                                     cv::VideoWriter& output_stream,
+                                     const cv::Mat& camera_matrix,
+                                     const cv::Mat& dist_coeffs,
+                                     const int interp,
+                                     const size_t queue_size)
+{
+    CV_Assert(input_stream.isOpened());
+    CV_Assert(output_stream.isOpened());
+    CV_Assert(queue_size>0);
+    size_t frames = 0;
+
+    BoundedQueue<cv::Mat> decoded(queue_size);
+    BoundedQueue<cv::Mat> remapped(queue_size);
+    std::exception_ptr decode_error, remap_error, encode_error;
+
+    std::thread decoder([&]()
+    {
+        try {
+            cv::Mat frame;
+            while (input_stream.read(frame) && !frame.empty())
+            {
+                if (!decoded.push(frame))
+                    break;
+                // The queued frame is shared, so a new one is read.
+                frame = cv::Mat();
+            }
+        }
+        catch (...) {
+            decode_error = std::current_exception();
+        }
+        decoded.close();
+    });
+
+    std::thread encoder([&]()
+    {
+        try {
+            cv::Mat frame;
+            while (remapped.pop(frame))
+                output_stream << frame;
+        }
+        catch (...) {
+            encode_error = std::current_exception();
+        }
+        // On error, this stops the other stages.
+        remapped.close();
+        decoded.close();
+    });
+
+    // Remap stage. The fixed point maps (CV_16SC2 + CV_16UC1) are taken
+    // from the map cache and cv::remap() runs in parallel on each frame.
+    try {
+        std::shared_ptr<const UndistortMaps> maps;
+        cv::Mat input;
+        while (decoded.pop(input))
+        {
+            if (!maps || maps->map1.size() != input.size())
+                maps = fsiv_get_undistort_maps(camera_matrix, dist_coeffs,
+                                               input.size(), interp);
+            if (!remapped.push(remap_image(input, *maps, interp)))
+                break;
+            ++frames;
+        }
+    }
+    catch (...) {
+        remap_error = std::current_exception();
+    }
+    decoded.close();
+    remapped.close();
+    decoder.join();
+    encoder.join();
+
+    for (const auto& error : {decode_error, remap_error, encode_error})
+        if (error)
+            std::rethrow_exception(error);
+    CV_Assert(input_stream.isOpened());
+    CV_Assert(output_stream.isOpened());
+    return frames;
+}
+
+size_t
+fsiv_undistort_images(const std::vector<std::string>& input_fnames,
+                      const std::vector<std::string>& output_fnames,
+                      const cv::Mat& camera_matrix,
+                      const cv::Mat& dist_coeffs,
+                      const std::string& map_cache_dir,
+                      const int io_threads,
+                      std::ostream* progress,
+                      std::vector<std::string>* failed)
+{
+    CV_Assert(input_fnames.size()==output_fnames.size());
+    CV_Assert(io_threads>0);
+
+    BoundedQueue<ImageJob> decoded(2*io_threads);
+    BoundedQueue<ImageJob> remapped(2*io_threads);
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> written(0);
+    std::atomic<int> decoders_left(io_threads);
+    std::mutex failed_mutex;
+    std::vector<std::string> failures;
+    const auto fail = [&](const std::string& fname)
+    {
+        std::lock_guard<std::mutex> lock(failed_mutex);
+        failures.push_back(fname);
+    };
+
+    // io_threads decoders and io_threads encoders. A file that can not be
+    // read or written is reported and skipped.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < io_threads; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            for (size_t i = next++; i < input_fnames.size(); i = next++)
+            {
+                ImageJob job;
+                job.index = i;
+                try {
+                    job.image = cv::imread(input_fnames[i]);
+                }
+                catch (const std::exception&) {
+                }
+                if (job.image.empty())
+                    fail(input_fnames[i]);
+                else if (!decoded.push(job))
+                    break;
+            }
+            if (--decoders_left == 0)
+                decoded.close();
+        });
+        threads.emplace_back([&]()
+        {
+            ImageJob job;
+            while (remapped.pop(job))
+            {
+                bool ok = false;
+                try {
+                    ok = cv::imwrite(output_fnames[job.index], job.image);
+                }
+                catch (const std::exception&) {
+                }
+                if (ok)
+                    ++written;
+                else
+                    fail(output_fnames[job.index]);
+            }
+        });
+    }
+
+    // Remap stage, with the cached maps.
+    std::exception_ptr error;
+    const int64 t0 = cv::getTickCount();
+    try {
+        std::shared_ptr<const UndistortMaps> maps;
+        size_t done = 0;
+        ImageJob job;
+        while (decoded.pop(job))
+        {
+            if (!maps || maps->map1.size() != job.image.size())
+                maps = fsiv_get_undistort_maps(camera_matrix, dist_coeffs,
+                                               job.image.size(), cv::INTER_LINEAR,
+                                               map_cache_dir);
+            job.image = remap_image(job.image, *maps, cv::INTER_LINEAR);
+            if (!remapped.push(job))
+                break;
+            if (progress != nullptr && ++done % PROGRESS_STEP == 0)
+            {
+                const double secs = (cv::getTickCount()-t0)/cv::getTickFrequency();
+                *progress << done << "/" << input_fnames.size() << " images, "
+                          << done/secs << " images/s." << std::endl;
+            }
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    decoded.close();
+    remapped.close();
+    for (auto& t : threads)
+        t.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    if (progress != nullptr)
+    {
+        const double secs = (cv::getTickCount()-t0)/cv::getTickFrequency();
+        *progress << written << " images written in " << secs << " s ("
+                  << written/secs << " images/s), " << failures.size()
+                  << " failed." << std::endl;
+    }
+    if (failed != nullptr)
+        *failed = failures;
+    return written;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <memory>
+#include <ostream>
+#include <string>
 #include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
@@ -28,6 +31,90 @@ std::vector<cv::Point3f> fsiv_generate_3d_calibration_points(const cv::Size& boa
 bool fsiv_find_chessboard_corners(const cv::Mat& img, const cv::Size &board_size,
                                   std::vector<cv::Point2f>& corner_points,
                                   const char * wname=nullptr);
+
+/**
+ * @brief Find a calibration chessboard on a downscaled copy of the image.
+ * The board is searched on a copy whose largest side is at most max_side
+ * pixels. Then the corners found are scaled up and refined with
+ * cv::cornerSubPix() on the full resolution image.
+ * @param img is the image where finding out.
+ * @param board_size is the inners board points geometry.
+ * @param[out] corner_points save the refined corner coordinates if the board was found.
+ * @param max_side is the largest side of the image used to search the board.
+ *  Value 0 means to search at full resolution.
+ * @return true if the board was found.
+ * @pre img.type()==CV_8UC3
+ * @pre max_side>=0
+ */
+bool fsiv_find_chessboard_corners_scaled(const cv::Mat& img,
+                                         const cv::Size &board_size,
+                                         std::vector<cv::Point2f>& corner_points,
+                                         int max_side=1024);
+
+/**
+ * @brief Find a calibration chessboard in several views in parallel.
+ * The views are loaded and the boards searched with
+ * fsiv_find_chessboard_corners_scaled() by a pool of threads
+ * (cv::parallel_for_). Only the corners of each view are kept in memory.
+ * If a cache file is given, the views found in it are not processed at all.
+ * A view is looked up by the hash (FNV-1a) of its file, the board size,
+ * max_side and the corner refinement settings. The new views (also the
+ * ones without board) are added to the file.
+ * @param fnames are the file names of the views.
+ * @param board_size is the inners board points geometry.
+ * @param[out] corner_points are the corners of each view, in the same order
+ *  as fnames. They are empty if the view could not be loaded or the board
+ *  was not found.
+ * @param[out] view_sizes are the image size of each view (0x0 if the view
+ *  could not be loaded).
+ * @param max_side is the largest side of the image used to search the board.
+ *  Value 0 means to search at full resolution.
+ * @param cache_fname is the corner cache file (YAML/XML). Empty means no cache.
+ * @return the number of views where the board was found.
+ * @pre max_side>=0
+ * @post corner_points.size()==fnames.size()
+ * @post view_sizes.size()==fnames.size()
+ */
+int fsiv_find_views_chessboard_corners(const std::vector<std::string>& fnames,
+                                       const cv::Size &board_size,
+                                       std::vector<std::vector<cv::Point2f>>& corner_points,
+                                       std::vector<cv::Size>& view_sizes,
+                                       int max_side=1024,
+                                       const std::string& cache_fname="");
+/**
+ * @brief Find a calibration chessboard in the frames of a video.
+ * The frames are screened cheaply on a gray copy downscaled to at most
+ * 320 pixels of side: a frame is rejected when it is blurry (variance of
+ * its Laplacian below min_sharpness) or when it barely differs from the
+ * last frame screened in (mean absolute difference below min_change gray
+ * levels). Only the frames that pass the screening are searched with
+ * fsiv_find_chessboard_corners_scaled(), in parallel batches.
+ * @param[in,out] input is the video.
+ * @param board_size is the inners board points geometry.
+ * @param[out] corner_points are the corners of each frame where the board
+ *  was found, in the video order.
+ * @param[out] frame_size is the size of the video frames.
+ * @param[out] frame_indices if it is not nullptr, save the index in the
+ *  video of each frame in corner_points.
+ * @param min_sharpness is the min variance of the Laplacian of a frame.
+ * @param min_change is the min mean absolute difference with the last
+ *  frame screened in.
+ * @param max_side is the largest side of the image used to search the board.
+ *  Value 0 means to search at full resolution.
+ * @return the number of frames read.
+ * @pre input.isOpened()
+ * @pre min_sharpness>=0.0 && min_change>=0.0 && max_side>=0
+ * @post frame_indices==nullptr || frame_indices->size()==corner_points.size()
+ */
+size_t fsiv_find_video_chessboard_corners(cv::VideoCapture& input,
+                                          const cv::Size &board_size,
+                                          std::vector<std::vector<cv::Point2f>>& corner_points,
+                                          cv::Size& frame_size,
+                                          std::vector<size_t>* frame_indices=nullptr,
+                                          double min_sharpness=100.0,
+                                          double min_change=8.0,
+                                          int max_side=1024);
+
 /**
  * @brief Calibrate a camara given the a sequence of 3D points and its correspondences in the plane image.
  * @param[in] _2d_points are the sequence of 2d corners detected per view.
@@ -48,6 +135,104 @@ float fsiv_calibrate_camera(
         std::vector<cv::Mat>* rvecs=nullptr,
         std::vector<cv::Mat>* tvecs=nullptr);
 
+/**
+ * @brief Select a bounded subset of informative views to calibrate.
+ * The views are scored by the coverage of the image plane (cells of a grid
+ * with corners not covered by the views already selected) and by the
+ * diversity of the board pose (angle between the board normal and the
+ * closest normal of the views already selected, with the pose estimated
+ * using a nominal camera). The view with the best score is picked greedily
+ * until max_views are selected.
+ * @param[in] _2d_points are the sequence of 2d corners detected per view.
+ * @param[in] _3d_points are the corresponding 3d points per view.
+ * @param[in] camera_size is the camera geometry in pixels.
+ * @param[in] max_views is the max number of views to select.
+ * @return the indices of the selected views, in increasing order.
+ * @pre _3d_points.size()==_2d_points.size()
+ * @pre max_views>=2
+ * @post ret_v.size()==min(max_views, _2d_points.size())
+ */
+std::vector<size_t> fsiv_select_calibration_views(
+        const std::vector<std::vector<cv::Point2f>>& _2d_points,
+        const std::vector<std::vector<cv::Point3f>>& _3d_points,
+        const cv::Size& camera_size,
+        size_t max_views);
+
+/**
+ * @brief Compute the reprojection error of a calibration over a set of views.
+ * The pose of each view is estimated with the given intrinsics, so the
+ * views do not need to be the ones used to calibrate.
+ * @param[in] _2d_points are the sequence of 2d corners detected per view.
+ * @param[in] _3d_points are the corresponding 3d points per view.
+ * @param[in] camera_matrix is the camera matrix.
+ * @param[in] dist_coeffs is the distortion coefficients.
+ * @param[out] rvecs is not null, it will save the rotation vector of each view.
+ * @param[out] tvecs is not null, it will save the translation vector of each view.
+ * @return the RMS reprojection error over all the points (the same measure
+ *  returned by fsiv_calibrate_camera()).
+ * @pre !_2d_points.empty() && _3d_points.size()==_2d_points.size()
+ */
+float fsiv_compute_reprojection_error(
+        const std::vector<std::vector<cv::Point2f>>& _2d_points,
+        const std::vector<std::vector<cv::Point3f>>& _3d_points,
+        const cv::Mat& camera_matrix,
+        const cv::Mat& dist_coeffs,
+        std::vector<cv::Mat>* rvecs=nullptr,
+        std::vector<cv::Mat>* tvecs=nullptr);
+
+/**
+ * @brief Calibrate a camera incrementally, as the views are added.
+ * It keeps the 3D -> 2D matches of all the views and re-solves the
+ * calibration each time a view is added. The first solve is a cold one.
+ * The next ones start from the last intrinsics (CALIB_USE_INTRINSIC_GUESS),
+ * so the per view extrinsics are initialized from them too, and stop as
+ * soon as the parameters stop changing. So each re-solve takes a fraction
+ * of a cold calibration.
+ */
+class IncrementalCalibrator
+{
+public:
+    /**
+     * @brief Create a calibrator.
+     * @param[in] camera_size is the camera geometry in pixels.
+     */
+    explicit IncrementalCalibrator(const cv::Size& camera_size);
+
+    /**
+     * @brief Add a view and re-solve the calibration.
+     * @param[in] _2d_points are the 2d corners detected in the view.
+     * @param[in] _3d_points are the corresponding 3d points.
+     * @return the reprojection error, or a negative value while there are
+     *  less than two views.
+     * @pre _3d_points.size()>=4 && _3d_points.size()==_2d_points.size()
+     */
+    float add_view(const std::vector<cv::Point2f>& _2d_points,
+                   const std::vector<cv::Point3f>& _3d_points);
+
+    /** @brief Number of views added. */
+    size_t views() const;
+    /** @brief Reprojection error of the last solve (negative if none). */
+    float error() const;
+    /** @brief Camera matrix of the last solve (empty if none). */
+    const cv::Mat& camera_matrix() const;
+    /** @brief Distortion coefficients of the last solve (empty if none). */
+    const cv::Mat& dist_coeffs() const;
+    /** @brief Rotation vector of each view in the last solve. */
+    const std::vector<cv::Mat>& rvecs() const;
+    /** @brief Translation vector of each view in the last solve. */
+    const std::vector<cv::Mat>& tvecs() const;
+
+private:
+    cv::Size camera_size_;
+    std::vector<std::vector<cv::Point2f>> _2d_points_;
+    std::vector<std::vector<cv::Point3f>> _3d_points_;
+    cv::Mat camera_matrix_;
+    cv::Mat dist_coeffs_;
+    std::vector<cv::Mat> rvecs_;
+    std::vector<cv::Mat> tvecs_;
+    float error_;
+};
+
 /**
  * @brief Project the 3D Camera Coordinate system on the image.
  * The X axis will be draw in red, the Y axis in green and the Z axis in blue.
@@ -140,16 +325,108 @@ void fsiv_load_calibration_parameters(cv::FileStorage &fs,
                                       cv::Mat& rvec,
                                       cv::Mat& tvec);
 
+/**
+ * @brief Undistortion maps (cv::initUndistortRectifyMap) shared by the map cache.
+ * map1 is CV_16SC2 and map2 is CV_16UC1 (fixed point maps).
+ * @warning it is shared by all the callers so it must not be modified.
+ */
+struct UndistortMaps
+{
+    cv::Mat map1;
+    cv::Mat map2;
+};
+
+/**
+ * @brief Get the undistortion maps from the map cache.
+ * The maps are built only the first time they are asked for. Later calls,
+ * from any thread, with the same camera_matrix, dist_coeffs, size and
+ * interp get the same maps.
+ * If cache_dir is not empty, the maps are also kept in that directory (one
+ * binary file per key), so other processes do not build them again.
+ * A map file is only used if its size, map types and checksum are the
+ * expected ones, else the maps are built and the file is written again.
+ * @param[in] camera_matrix is the camera matrix.
+ * @param[in] dist_coeffs are the distortion coefficients.
+ * @param[in] size is the image size.
+ * @param[in] interp is the interpolation method the maps will be used with.
+ * @param[in] cache_dir is the directory of the map files. Empty means no files.
+ * @return the maps.
+ * @pre size.width>0 && size.height>0
+ */
+std::shared_ptr<const UndistortMaps> fsiv_get_undistort_maps(
+        const cv::Mat& camera_matrix,
+        const cv::Mat& dist_coeffs,
+        const cv::Size& size,
+        int interp = cv::INTER_LINEAR,
+        const std::string& cache_dir = "");
+
+/**
+ * @brief Save the calibration parameters to a file.
+ * If the file name ends with ".calib", the compact binary format is used:
+ * a versioned header with the parameters (CV_64F values, host byte order),
+ * optionally followed by the undistortion maps for camera_size, with a
+ * checksum of the whole file. Else the file is written with cv::FileStorage
+ * (YAML/XML), see fsiv_save_calibration_parameters(cv::FileStorage&, ...).
+ * @param[in] fname is the file name.
+ * @param[in] camera_size is the camera geometry in pixels.
+ * @param[in] error is the calibration error.
+ * @param[in] camera_matrix is the camera matrix.
+ * @param[in] dist_coeffs are the distortion coefficients.
+ * @param[in] rvec is the rotation vector.
+ * @param[in] tvec is the translation vector.
+ * @param[in] with_maps if it is true, the binary file also keeps the
+ *  undistortion maps (fsiv_get_undistort_maps() with cv::INTER_LINEAR).
+ * @pre camera_matrix.type()==CV_64FC1 && camera_matrix is 3x3
+ * @pre dist_coeffs.type()==CV_64FC1 && dist_coeffs is 1x5
+ * @pre rvec, tvec are 3x1 CV_64FC1
+ */
+void fsiv_save_calibration_parameters(const std::string& fname,
+                                      const cv::Size &camera_size,
+                                      float error,
+                                      const cv::Mat& camera_matrix,
+                                      const cv::Mat& dist_coeffs,
+                                      const cv::Mat& rvec = cv::Mat::zeros(3,1,CV_64FC1),
+                                      const cv::Mat& tvec = cv::Mat::zeros(3,1,CV_64FC1),
+                                      bool with_maps = false);
+
+/**
+ * @brief Load the calibration parameters from a file of any format.
+ * The format is detected by the file content. A binary file is memory
+ * mapped and its values copied, without parsing, once its version and
+ * checksum are checked. If it keeps the undistortion maps, they are added
+ * to the map cache, so fsiv_get_undistort_maps() will not build them.
+ * Other files are read with cv::FileStorage, see
+ * fsiv_load_calibration_parameters(cv::FileStorage&, ...).
+ * @param[in] fname is the file name.
+ * @param[out] camera_size is the camera geometry in pixels.
+ * @param[out] error is the calibration error.
+ * @param[out] camera_matrix is the camera matrix.
+ * @param[out] dist_coeffs are the distortion coefficients.
+ * @param[out] rvec is the rotation vector.
+ * @param[out] tvec is the translation vector.
+ */
+void fsiv_load_calibration_parameters(const std::string& fname,
+                                      cv::Size &camera_size,
+                                      float& error,
+                                      cv::Mat& camera_matrix,
+                                      cv::Mat& dist_coeffs,
+                                      cv::Mat& rvec,
+                                      cv::Mat& tvec);
+
 /**
  * @brief Correct the len's distorntions of an image.
+ * The undistortion maps are taken from the map cache (fsiv_get_undistort_maps()),
+ * so only a remap is done per image.
  * @param[in] input the distorted image.
  * @param[out] output the corrected image.
  * @param[in] camera_matrix is the camera matrix.
  * @param[in] dist_coeffs are the distortion coefficients.
+ * @param[in] map_cache_dir is the directory of the map files. Empty means no files.
  */
 void fsiv_undistort_image(const cv::Mat& input, cv::Mat& output,
                           const cv::Mat& camera_matrix,
-                          const cv::Mat& dist_coeffs);
+                          const cv::Mat& dist_coeffs,
+                          const std::string& map_cache_dir = "");
 /**
  * @brief Correct the len's distortions from a input video stream.
  * @param[in|out] input is the input distorted video stream.
@@ -173,3 +450,57 @@ void fsiv_undistort_video_stream(cv::VideoCapture&input_stream,
                                  const char * input_wname=nullptr,
                                  const char * output_wname=nullptr,
                                  double fps=0.0);
+
+/**
+ * @brief Correct the len's distortions from a input video stream, without display.
+ * It is a pipeline of three stages running at the same time: decoding,
+ * remapping and encoding, connected by queues of at most queue_size frames.
+ * The remapping uses fixed point maps (CV_16SC2) and each frame is remapped
+ * in parallel by cv::remap().
+ * @param[in|out] input is the input distorted video stream.
+ * @param[out] output is the corrected output video stream.
+ * @param[in] camera_matrix is the camera matrix.
+ * @param[in] dist_coeffs are the distortion coefficients.
+ * @param[in] interp specifies the interpolation method to use.
+ * @param[in] queue_size is the max number of frames waiting between two stages.
+ * @return the number of frames processed.
+ * @pre input.isOpened()
+ * @pre output.isOpened()
+ * @pre queue_size>0
+ * @post input.isOpened()
+ * @post output.isOpened()
+ */
+size_t fsiv_undistort_video_stream_headless(cv::VideoCapture& input_stream,
+                                            cv::VideoWriter& output_stream,
+                                            const cv::Mat& camera_matrix,
+                                            const cv::Mat& dist_coeffs,
+                                            const int interp = cv::INTER_LINEAR,
+                                            const size_t queue_size = 4);
+
+/**
+ * @brief Correct the len's distortions of a batch of images, without display.
+ * The images are decoded by io_threads threads (prefetching), remapped with
+ * the cached maps (fsiv_get_undistort_maps()) in parallel by cv::remap() and
+ * encoded by other io_threads threads, all at the same time.
+ * @param[in] input_fnames are the distorted image files.
+ * @param[in] output_fnames are the corrected image files, one per input.
+ * @param[in] camera_matrix is the camera matrix.
+ * @param[in] dist_coeffs are the distortion coefficients.
+ * @param[in] map_cache_dir is the directory of the map files. Empty means no files.
+ * @param[in] io_threads is the number of decoding (and of encoding) threads.
+ * @param[out] progress if it is not nullptr, the progress and the throughput
+ *  are reported on it.
+ * @param[out] failed if it is not nullptr, save the files that could not be
+ *  read or written.
+ * @return the number of images written.
+ * @pre input_fnames.size()==output_fnames.size()
+ * @pre io_threads>0
+ */
+size_t fsiv_undistort_images(const std::vector<std::string>& input_fnames,
+                             const std::vector<std::string>& output_fnames,
+                             const cv::Mat& camera_matrix,
+                             const cv::Mat& dist_coeffs,
+                             const std::string& map_cache_dir = "",
+                             const int io_threads = 2,
+                             std::ostream* progress = nullptr,
+                             std::vector<std::string>* failed = nullptr);
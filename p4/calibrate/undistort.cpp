@@ -11,6 +11,13 @@
 
 #include <iostream>
 #include <exception>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
 
 //Includes para OpenCV, Descomentar según los módulo utilizados.
 #include <opencv2/core/core.hpp>
@@ -25,11 +32,50 @@ const cv::String keys =
     "{help h usage ? |      | print this message.}"
     "{v video        |      | the input is a video file.}"
     "{fourcc         |      | output video codec used, for example \"MJPG\". Default same as input.}"
+    "{headless       |      | process the video without display, in a decode/remap/encode pipeline.}"
+    "{map_cache      |      | directory where the undistortion maps are kept between runs.}"
+    "{b batch        |      | batch mode without display: the input is a directory or a file with a list of images, and the output is an existing directory. The input images must have different names.}"
+    "{io_threads     |2     | number of threads decoding (and encoding) images in batch mode.}"
     "{@intrinsics    |<none>| intrinsics parameters file.}"
     "{@input         |<none>| input image|video.}"
     "{@output        |<none>| output image|video.}"
     ;
 
+// The images of a batch: the image files of a directory, or the lines of
+// a list file.
+std::vector<std::string>
+batch_input_fnames(const std::string& input)
+{
+    std::vector<std::string> fnames;
+    struct stat st;
+    if (stat(input.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        const char* extensions[] = {".jpg", ".jpeg", ".png", ".bmp", ".tif",
+                                    ".tiff", ".ppm", ".pgm", ".webp"};
+        std::vector<cv::String> files;
+        cv::glob(input + "/*", files, false);
+        for (const auto& f : files)
+        {
+            const size_t dot = f.rfind('.');
+            if (dot == std::string::npos)
+                continue;
+            std::string ext = f.substr(dot);
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if (std::find(std::begin(extensions), std::end(extensions), ext)
+                != std::end(extensions))
+                fnames.push_back(f);
+        }
+    }
+    else
+    {
+        std::ifstream list(input);
+        std::string line;
+        while (std::getline(list, line))
+            if (!line.empty())
+                fnames.push_back(line);
+    }
+    return fnames;
+}
 
 int
 main (int argc, char* const* argv)
@@ -43,6 +89,10 @@ main (int argc, char* const* argv)
         return EXIT_SUCCESS;
     }
     auto is_video = parser.has("v");
+    auto headless = parser.has("headless");
+    std::string map_cache_dir = parser.has("map_cache") ? parser.get<std::string>("map_cache") : "";
+    auto is_batch = parser.has("b");
+    auto io_threads = parser.get<int>("io_threads");
     auto calib_fname = parser.get<std::string>("@intrinsics");
     auto input_fname = parser.get<std::string>("@input");
     auto output_fname = parser.get<std::string>("@output");
@@ -59,14 +109,50 @@ main (int argc, char* const* argv)
         cv::Mat K, dist_coeffs, rvec, tvec;
 
         //TODO: First load the calibration parameters.
-        cv::FileStorage fs_input (calib_fname, cv::FileStorage::READ);
-        fsiv_load_calibration_parameters(fs_input, camera_size, error, 
+        fsiv_load_calibration_parameters(calib_fname, camera_size, error,
             K, dist_coeffs, rvec, tvec);
-        fs_input.release();
         //
 
-        cv::namedWindow("INPUT", cv::WINDOW_GUI_EXPANDED+cv::WINDOW_AUTOSIZE);
-        cv::namedWindow("OUTPUT", cv::WINDOW_GUI_EXPANDED+cv::WINDOW_AUTOSIZE);
+        if (is_batch)
+        {
+            struct stat st;
+            if (stat(output_fname.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            {
+                std::cerr << "Error: the output directory '" << output_fname
+                          << "' does not exist." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            // The output files have the input names, in the output directory.
+            // Two inputs with the same name (from a list file) would write the
+            // same output file, so they are rejected.
+            const std::vector<std::string> input_fnames = batch_input_fnames(input_fname);
+            std::vector<std::string> output_fnames;
+            std::set<std::string> names;
+            for (const auto& f : input_fnames)
+            {
+                const std::string name = f.substr(f.find_last_of("/\\") + 1);
+                if (!names.insert(name).second)
+                {
+                    std::cerr << "Error: more than one input image is named '"
+                              << name << "'." << std::endl;
+                    return EXIT_FAILURE;
+                }
+                output_fnames.push_back(output_fname + "/" + name);
+            }
+            std::vector<std::string> failed;
+            fsiv_undistort_images(input_fnames, output_fnames, K, dist_coeffs,
+                                  map_cache_dir, io_threads, &std::cout, &failed);
+            for (const auto& f : failed)
+                std::cerr << "Error: could not process file '" << f << "'." << std::endl;
+            return failed.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (!(is_video && headless))
+        {
+            cv::namedWindow("INPUT", cv::WINDOW_GUI_EXPANDED+cv::WINDOW_AUTOSIZE);
+            cv::namedWindow("OUTPUT", cv::WINDOW_GUI_EXPANDED+cv::WINDOW_AUTOSIZE);
+        }
         //TODO
 
         //
@@ -86,8 +172,18 @@ main (int argc, char* const* argv)
                 vid_output = cv::VideoWriter(output_fname, vid_input.get(cv::CAP_PROP_FOURCC),
                      fps, camera_size);
 
-            fsiv_undistort_video_stream(vid_input, vid_output, K, dist_coeffs, 
-                1, "INPUT", "OUTPUT", fps);
+            if (headless)
+            {
+                const int64 t0 = cv::getTickCount();
+                const size_t frames = fsiv_undistort_video_stream_headless(
+                    vid_input, vid_output, K, dist_coeffs, cv::INTER_LINEAR);
+                const double secs = (cv::getTickCount()-t0)/cv::getTickFrequency();
+                std::cout << frames << " frames in " << secs << " s ("
+                          << frames/secs << " fps)." << std::endl;
+            }
+            else
+                fsiv_undistort_video_stream(vid_input, vid_output, K, dist_coeffs, 
+                    1, "INPUT", "OUTPUT", fps);
             //
         }
         else
@@ -95,7 +191,7 @@ main (int argc, char* const* argv)
             //TODO
             cv::Mat img_input, img_output;
             img_input = cv::imread(input_fname);
-            fsiv_undistort_image(img_input, img_output, K, dist_coeffs);
+            fsiv_undistort_image(img_input, img_output, K, dist_coeffs, map_cache_dir);
 
             cv::imshow("INPUT", img_input);
             cv::imshow("OUTPUT", img_output);